@@ -0,0 +1,482 @@
+/**
+ * Benchmarks for the shell's hot paths, built with optimization by `make bench`.
+ * Prints one JSON object to stdout; everything the shell itself prints while
+ * being measured goes to /dev/null.
+ *
+ * Usage: mysh-bench [-q]    (-q runs fewer iterations, for a quick smoke run)
+ *        mysh-bench --mysh ...  runs the shell itself, as the serve baseline
+ */
+
+#define MYSH_NO_MAIN
+#include "../mysh.cpp"
+
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <sys/prctl.h>
+
+struct MyshBench {
+    explicit MyshBench(long scale) : scale(scale) {
+        mysh = new Mysh(new Mysh::LineReader(std::string()));
+    }
+
+    ~MyshBench() {
+        delete mysh;
+    }
+
+    void Tokenize() {
+        const std::vector<std::string> lines = {
+                "run ls -l /usr/bin",
+                "background ./worker --threads 8 --queue \"jobs/incoming work\" > worker.log 2>&1",
+                "run seq 1 1000000 | tap numbers.txt | wc -l",
+                "repeat -j 16 1000 ./worker --once",
+                "movetodir '../../projects/OS/homework/'",
+        };
+        long n = 200000 * scale / 10;
+        size_t bytes = 0;
+        for (const auto &line : lines)
+            bytes += line.size();
+
+        Mysh::Tokenizer tokenizer;
+        size_t tokens = 0;
+        double seconds = Time([&]() {
+            for (long i = 0; i < n; i++) {
+                for (const auto &line : lines) {
+                    tokenizer.Tokenize(line);
+                    tokens += tokenizer.tokens.size();
+                }
+            }
+        });
+
+        // The original ProcessInput's splitter, with its regex built again for every line
+        long baselineN = n / 20;
+        size_t baselineTokens = 0;
+        double baselineSeconds = Time([&]() {
+            for (long i = 0; i < baselineN; i++) {
+                for (const auto &line : lines)
+                    baselineTokens += TokenizeInput(line).size();
+            }
+        });
+
+        Result("tokenize", {
+                {"tokens_per_sec", (double) tokens / seconds},
+                {"lines_per_sec", (double) (n * lines.size()) / seconds},
+                {"mb_per_sec", (double) (n * bytes) / seconds / 1e6},
+                {"baseline_tokens_per_sec", (double) baselineTokens / baselineSeconds},
+                {"baseline_lines_per_sec", (double) (baselineN * lines.size()) / baselineSeconds},
+        });
+    }
+
+    void Dispatch() {
+        const std::vector<std::string_view> names = {
+                "run", "background", "history", "jobs", "repeat", "exterminateall", "nosuchcommand", "whereami",
+        };
+        long n = 2000000 * scale / 10;
+        long found = 0;
+        double seconds = Time([&]() {
+            for (long i = 0; i < n; i++) {
+                for (auto name : names)
+                    found += mysh->DetermineCommand(name) != nullptr;
+            }
+        });
+
+        Result("dispatch", {
+                {"ns_per_lookup", seconds * 1e9 / (double) (n * names.size())},
+                {"found", (double) found},
+        });
+    }
+
+    void Spawn() {
+        long n = 500 * scale / 10;
+        std::vector<std::string_view> parameters = {"/bin/true"};
+        char **arguments = Mysh::ProcessHandler::InputParametersToCharArguments(parameters);
+        Mysh::ProcessHandler *processHandler = mysh->processHandler;
+
+        for (auto engine : {Mysh::ProcessHandler::fork_engine, Mysh::ProcessHandler::posix_spawn_engine}) {
+            processHandler->spawnEngine = engine;
+            Mysh::Histogram micros;
+            int status;
+            double seconds = Time([&]() {
+                for (long i = 0; i < n; i++) {
+                    auto start = std::chrono::steady_clock::now();
+                    processHandler->ForkExecWait(arguments, {}, &status);
+                    micros.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count());
+                }
+            });
+
+            Result(engine == Mysh::ProcessHandler::fork_engine ? "spawn_fork" : "spawn_posix_spawn", {
+                    {"mean_us", seconds * 1e6 / (double) n},
+                    {"p50_us", (double) micros.Percentile(50)},
+                    {"p99_us", (double) micros.Percentile(99)},
+            });
+        }
+
+        Mysh::ProcessHandler::FreeCharArguments(arguments);
+    }
+
+    void Repeat() {
+        long n = 2000 * scale / 10;
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        std::vector<std::string_view> parameters = {"/bin/true"};
+        char **arguments = Mysh::ProcessHandler::InputParametersToCharArguments(parameters);
+
+        double seconds = Time([&]() {
+            mysh->processHandler->RepeatCommand(arguments, {}, n, cores);
+        });
+
+        Mysh::ProcessHandler::FreeCharArguments(arguments);
+        Result("repeat", {
+                {"jobs", (double) n},
+                {"in_flight", (double) cores},
+                {"jobs_per_sec", (double) n / seconds},
+        });
+    }
+
+    // A two-stage pipeline in the shell against handing it to sh -c
+    void Pipeline() {
+        long n = 300 * scale / 10;
+        Mysh::ProcessHandler *processHandler = mysh->processHandler;
+
+        Mysh::Tokenizer tokenizer;
+        tokenizer.Tokenize("run /bin/true | /bin/true");
+        std::vector<std::string_view> stages(tokenizer.tokens.begin() + 1, tokenizer.tokens.end());
+        double seconds = Time([&]() {
+            for (long i = 0; i < n; i++)
+                processHandler->RunPipeline(stages, false, {});
+        });
+
+        std::vector<std::string_view> parameters = {"/bin/sh", "-c", "/bin/true | /bin/true"};
+        char **arguments = Mysh::ProcessHandler::InputParametersToCharArguments(parameters);
+        int status;
+        double shellSeconds = Time([&]() {
+            for (long i = 0; i < n; i++)
+                processHandler->ForkExecWait(arguments, {}, &status);
+        });
+        Mysh::ProcessHandler::FreeCharArguments(arguments);
+
+        Result("pipeline", {
+                {"mysh_us", seconds * 1e6 / (double) n},
+                {"sh_c_us", shellSeconds * 1e6 / (double) n},
+        });
+    }
+
+    // Regression check: `yes | tap | head -1` has to end once head exits, true if it did within 5s
+    bool TapEarlyExit() {
+        std::string path = "/tmp/mysh-bench-tap-" + std::to_string(getpid());
+        std::string line = "run yes | tap " + path + " | head -1";
+
+        // Stages orphaned by a hung check come back to us, so they can be killed below
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+        auto start = std::chrono::steady_clock::now();
+        pid_t child = fork();
+        if (child == 0) {
+            mysh->ProcessInput(line);
+            _exit(0);
+        }
+
+        int status;
+        bool ended = false;
+        while (!ended && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+            ended = waitpid(child, &status, WNOHANG) == child;
+            if (!ended)
+                usleep(1000);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ended) {
+            kill(child, SIGKILL);
+            waitpid(child, &status, 0);
+            KillOrphans();
+        }
+        prctl(PR_SET_CHILD_SUBREAPER, 0);
+        unlink(path.c_str());
+
+        Result("tap_early_exit", {
+                {"ended", ended ? 1.0 : 0.0},
+                {"ms", seconds * 1e3},
+        });
+        return ended;
+    }
+
+    // Regression check: a literal, so parsed once, redirected run in a script loop has to
+    // redirect on every iteration
+    bool ScriptRedirect() {
+        std::string path = "/tmp/mysh-bench-script-" + std::to_string(getpid());
+        unlink(path.c_str());
+
+        Mysh::LineReader script("for i in 1..3\n    run echo hi >> " + path + "\nend\n");
+        mysh->scriptHandler->RunScript(script, "bench", {});
+
+        std::ifstream file(path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        unlink(path.c_str());
+
+        bool redirected = contents.str() == "hi\nhi\nhi\n";
+        Result("script_redirect", {
+                {"redirected", redirected ? 1.0 : 0.0},
+        });
+        return redirected;
+    }
+
+    // A script of builtins run end to end, read by LineReader against the original
+    // std::getline(std::cin) loop feeding the same ProcessInput
+    void Batch() {
+        const char *lines[] = {"stats -c\n", "hash -r\n", "whereami\n", "movetodir .\n", "\n"};
+        long n = 200000 * scale / 10;
+        std::string script;
+        for (long i = 0; i < n; i++)
+            script += lines[i % 5];
+
+        // Both read the script as their stdin, from the same file
+        char path[] = "/tmp/mysh-bench-batch-XXXXXX";
+        int fd = mkstemp(path);
+        int savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+        if (fd == -1 || savedIn == -1 || write(fd, script.data(), script.size()) != (ssize_t) script.size()) {
+            perror("mysh-bench");
+            return;
+        }
+        unlink(path);
+
+        lseek(fd, 0, SEEK_SET);
+        dup2(fd, STDIN_FILENO);
+        double seconds = Time([&]() {
+            Mysh batch(new Mysh::LineReader(STDIN_FILENO));
+            batch.Start();
+        });
+
+        lseek(fd, 0, SEEK_SET);
+        dup2(fd, STDIN_FILENO);
+        std::cin.clear();
+        long read = 0;
+        double getlineSeconds = Time([&]() {
+            Mysh batch(new Mysh::LineReader(std::string()));
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                Mysh::ErrorCodeHandler::HandleErrorCode(batch.ProcessInput(line));
+                read++;
+            }
+        });
+
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+        close(fd);
+        std::cin.clear();
+
+        Result("batch", {
+                {"lines", (double) n},
+                {"lines_per_sec", (double) n / seconds},
+                {"getline_baseline_lines_per_sec", (double) read / getlineSeconds},
+        });
+    }
+
+    // The same loop of builtins parsed once by source against line by line through ProcessInput
+    void Script() {
+        long n = 100000 * scale / 10;
+        std::string line = "hash -r";
+
+        double lineSeconds = Time([&]() {
+            for (long i = 0; i < n; i++)
+                mysh->ProcessInput(line);
+        });
+
+        Mysh::LineReader script("for i in 1.." + std::to_string(n) + "\n    hash -r\nend\n");
+        double scriptSeconds = Time([&]() {
+            mysh->scriptHandler->RunScript(script, "bench", {});
+        });
+
+        Result("script", {
+                {"iterations", (double) n},
+                {"process_input_ns", lineSeconds * 1e9 / (double) n},
+                {"script_ns", scriptSeconds * 1e9 / (double) n},
+                {"speedup", lineSeconds / scriptSeconds},
+        });
+    }
+
+    // Batches from concurrent clients of one --serve process, against a fresh mysh per batch
+    void Serve() {
+        long n = 20000 * scale / 10;
+        long clients = 8;
+        std::string path = "/tmp/mysh-bench-" + std::to_string(getpid()) + ".sock";
+
+        pid_t server = fork();
+        if (server == 0) {
+            Mysh served(new Mysh::LineReader(std::string()));
+            _exit(served.Serve(path));
+        }
+        for (int tries = 0; tries < 1000 && access(path.c_str(), F_OK) == -1; tries++)
+            usleep(1000);
+
+        int status;
+        long failed = 0;
+        double seconds = Time([&]() {
+            std::vector<pid_t> pids;
+            for (long c = 0; c < clients; c++) {
+                pid_t pid = fork();
+                if (pid == 0)
+                    _exit(Requests(path, n / clients) ? 0 : 1);
+                pids.push_back(pid);
+            }
+            for (pid_t pid : pids)
+                failed += waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        });
+        kill(server, SIGTERM);
+        waitpid(server, &status, 0);
+
+        // What the orchestrator pays today: process startup and Mysh construction per batch
+        long baselineN = n / 20;
+        std::vector<std::string_view> parameters = {"/proc/self/exe", "--mysh", "-c", "hash -r"};
+        char **arguments = Mysh::ProcessHandler::InputParametersToCharArguments(parameters);
+        double baselineSeconds = Time([&]() {
+            mysh->processHandler->RepeatCommand(arguments, {}, baselineN, clients);
+        });
+        Mysh::ProcessHandler::FreeCharArguments(arguments);
+
+        double requests = (double) (n / clients * clients);
+        Result("serve", {
+                {"clients", (double) clients},
+                {"requests", requests},
+                {"failed_clients", (double) failed},
+                {"requests_per_sec", requests / seconds},
+                {"mean_latency_us", seconds * 1e6 * (double) clients / requests},
+                {"fresh_process_requests_per_sec", (double) baselineN / baselineSeconds},
+        });
+    }
+
+    std::string Json() const {
+        return "{\n" + json + "\n}\n";
+    }
+
+private:
+    long scale;
+
+    // Verbatim from the shell before the Tokenizer: split on whitespace runs, no quoting
+    static std::vector<std::string> TokenizeInput(const std::string &line) {
+        auto const regex = std::regex{R"(\s+)"};
+
+        auto tokens = std::vector<std::string>(
+                std::sregex_token_iterator{begin(line), end(line), regex, -1},
+                std::sregex_token_iterator{});
+
+        return tokens;
+    }
+
+    // Kills and reaps every process that was reparented to us
+    static void KillOrphans() {
+        DIR *proc = opendir("/proc");
+        if (proc == nullptr)
+            return;
+        while (struct dirent *entry = readdir(proc)) {
+            pid_t pid = atoi(entry->d_name);
+            std::ifstream stat("/proc/" + std::string(entry->d_name) + "/stat");
+            std::string line;
+            if (pid <= 0 || !std::getline(stat, line))
+                continue;
+            // ppid is the second field after the parenthesized command name
+            std::istringstream fields(line.substr(line.rfind(')') + 2));
+            char state;
+            pid_t ppid;
+            if (fields >> state >> ppid && ppid == getpid()) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+            }
+        }
+        closedir(proc);
+    }
+
+    // One client sending a batch at a time and waiting for its done record
+    static bool Requests(const std::string &path, long count) {
+        struct sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || connect(fd, (const struct sockaddr *) &address, sizeof(address)) == -1)
+            return false;
+
+        const char request[] = "hash -r\n\n";
+        std::string received;
+        char chunk[4096];
+        for (long i = 0; i < count; i++) {
+            if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1)
+                return false;
+            while (received.find("\"done\":true") == std::string::npos) {
+                ssize_t got = read(fd, chunk, sizeof(chunk));
+                if (got <= 0)
+                    return false;
+                received.append(chunk, got);
+            }
+            received.erase(0, received.find('\n', received.find("\"done\":true")) + 1);
+        }
+        close(fd);
+        return true;
+    }
+    Mysh *mysh;
+    std::string json;
+
+    template<typename F>
+    static double Time(F body) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void Result(const char *name, std::initializer_list<std::pair<const char *, double>> fields) {
+        char value[64];
+        if (!json.empty())
+            json += ",\n";
+        json += std::string("  \"") + name + "\": {";
+        bool first = true;
+        for (const auto &[field, number] : fields) {
+            snprintf(value, sizeof(value), "%s\"%s\": %.6g", first ? "" : ", ", field, number);
+            json += value;
+            first = false;
+        }
+        json += "}";
+    }
+};
+
+int main(int argc, char **argv) {
+    // The serve bench's baseline starts whole shells from this binary
+    if (argc > 1 && strcmp(argv[1], "--mysh") == 0)
+        return TestMysh(argc - 1, argv + 1);
+
+    long scale = argc > 1 && strcmp(argv[1], "-q") == 0 ? 1 : 10;
+
+    // The shell prints while it works, only the JSON goes to the real stdout
+    // Close-on-exec, or a hung child would hold whatever reads the JSON open
+    int out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (out == -1 || devNull == -1 || dup2(devNull, STDOUT_FILENO) == -1) {
+        perror("mysh-bench");
+        return 1;
+    }
+    close(devNull);
+
+    std::string json;
+    bool failed = false;
+    {
+        MyshBench bench(scale);
+        bench.Tokenize();
+        bench.Dispatch();
+        bench.Spawn();
+        bench.Repeat();
+        bench.Pipeline();
+        if (!bench.TapEarlyExit())
+            failed = true;
+        bench.Batch();
+        bench.Script();
+        if (!bench.ScriptRedirect())
+            failed = true;
+        bench.Serve();
+        json = bench.Json();
+    }
+
+    std::cout << std::flush;
+    if (write(out, json.data(), json.size()) != (ssize_t) json.size()) {
+        perror("mysh-bench");
+        return 1;
+    }
+    if (failed)
+        fprintf(stderr, "mysh-bench: a regression check failed\n");
+    return failed ? 1 : 0;
+}
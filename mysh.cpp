@@ -1,9 +1,36 @@
 #include <vector>
 #include <iostream>
+#include <climits>
 #include <cstring>
+#include <deque>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <regex>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <spawn.h>
 #include <unistd.h>
 #include <wait.h>
+#include <fcntl.h>
+#include <csignal>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
 
 /**
  * Written by Mykola Maslych for COP4600 with Dr. Ladislau Boloni in Fall 2020
@@ -13,6 +40,9 @@
  * Commands:
  * - movetodir
  *      change directory. internal variable. if doesn't exist -> error message
+ *      -j fragment... jumps to the most frecent visited match
+ * - pushd [dir] / popd / dirs
+ *      directory stack
  * - whereami
  *      print current dir
  * - history [-c]
@@ -24,14 +54,56 @@
  *      / for full path, else relative
  *      exec with params fork() + exec(), wait to terminate with waitpid()
  *      can't exec -> err msg
- * - background program [parameters]
+ * - background [--capture | --log FILE] program [parameters]
  *      commands before, but print PID and returns to prompt
- * - exterminate PID
- *      kill() -> success/failure
- * - exterminateall
- *      print each murdered pid
- * - repeat n command
- *      repeat command n times
+ *      --capture keeps the output in a ring buffer for joblog instead
+ * - run/background/repeat ... < in > out >> append 2> err 2>&1
+ *      redirect the launched program's stdio
+ * - run/background a | b | c
+ *      pipeline in one process group, `tap FILE` as a stage copies the stream
+ *      into FILE with tee()/splice()
+ * - exterminate [--grace 2s] PID
+ *      SIGTERM, SIGKILL if still alive after the grace period
+ * - exterminateall [--grace 2s]
+ *      SIGTERM every job's process group, SIGKILL those still alive after
+ *      the grace period, print each murdered pid
+ * - repeat [-j N] n command
+ *      repeat command n times, at most N at once (default: one per core),
+ *      wait for all of them and print the totals
+ * - repeat --rate R/s [--duration 30s] [-j N] [n] command
+ *      start copies at a steady rate instead, print progress every second and
+ *      the achieved rate and latency percentiles at the end
+ * - spawnengine [fork|posix_spawn]
+ *      select how children are started, print the current engine
+ * - jobs
+ *      list background jobs with their state and run time
+ * - wait [--any] [--timeout 10s] [pid...]
+ *      block until the jobs (default: all) exit, print how they ended
+ * - parallel [-j N] [-k] command [{}] < list | ::: item...
+ *      run command once per item, output buffered per job, -k keeps input order
+ * - joblog pid [-f]
+ *      output of a background --capture job, -f to follow it
+ * - cached run program [parameters] / cache stats|clear
+ *      replay the stored output of an identical earlier run
+ * - time command
+ *      run a command, report wall time and the rusage of its children
+ * - stats [-c]
+ *      wall time and launch latency percentiles per program, -c to reset
+ * - hash [-r | name...]
+ *      show the cached PATH lookups, clear them, or resolve names ahead
+ * - source file [arguments]
+ *      parse a script once, then run it: set, for i in A..B / for x in ...,
+ *      if [!] command ... else ... end, function name ... end, {var}, {1}, {#}, {?}
+ *
+ * Invocation:
+ * - mysh                   interactive when stdin is a terminal, batch otherwise
+ * - mysh -f script.mysh    run a script file, one command per line
+ * - mysh -c "command"      run the given command lines
+ * - mysh --serve sock      answer command batches from clients on a Unix socket
+ * - mysh --connect sock [-c "command"]
+ *                          send stdin (or the command) to a server, print the replies
+ * Batch mode prints no prompt, stops at EOF and exits with the status of the
+ * last command.
  */
 
 enum ErrorCode {
@@ -41,15 +113,67 @@ enum ErrorCode {
     dir_does_not_exist = 3,
     child_process_error = 4,
     could_not_kill = 5,
+    syntax_error = 6,
     request_exit = 10,
 };
 
+/**
+ * Builtin keywords, resolved through a perfect hash whose seed is searched
+ * at compile time. Keywords outside this list can still be registered at
+ * runtime, they just go through a hash map instead.
+ */
+constexpr std::string_view BUILTIN_KEYWORDS[] = {
+        "history", "byebye", "whereami", "movetodir", "run", "background",
+        "exterminate", "exterminateall", "repeat", "spawnengine", "hash",
+        "jobs", "time", "stats", "parallel", "joblog", "pushd", "popd", "dirs",
+        "cached", "cache", "source", "wait",
+};
+constexpr size_t BUILTIN_TABLE_SIZE = 64;
+
+constexpr uint32_t HashKeyword(std::string_view keyword, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : keyword) {
+        hash ^= (unsigned char) c;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 15;
+    return hash;
+}
+
+constexpr uint32_t FindKeywordSeed() {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        bool taken[BUILTIN_TABLE_SIZE] = {};
+        bool collision = false;
+        for (auto keyword : BUILTIN_KEYWORDS) {
+            size_t slot = HashKeyword(keyword, seed) & (BUILTIN_TABLE_SIZE - 1);
+            if (taken[slot]) {
+                collision = true;
+                break;
+            }
+            taken[slot] = true;
+        }
+        if (!collision)
+            return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t BUILTIN_KEYWORD_SEED = FindKeywordSeed();
+static_assert(BUILTIN_KEYWORD_SEED != UINT32_MAX, "no perfect hash seed for the builtin keywords");
+
+// Benchmark harness in bench/, which includes this file with MYSH_NO_MAIN
+struct MyshBench;
+
 class Mysh {
+    friend struct MyshBench;
+
     class Command {
     public:
         std::string keyword;
+        // Execute edits the parameter vector, so callers that reuse one pass a copy
+        bool consumesParameters = false;
 
-        bool InputParametersAreValid(std::vector<std::string> &iPs) {
+        bool InputParametersAreValid(std::vector<std::string_view> &iPs) {
             if (allowCustomParameters)
                 return true;
 
@@ -65,7 +189,7 @@ class Mysh {
             return true;
         }
 
-        virtual ErrorCode Execute(std::vector<std::string> &inputParameters) = 0;
+        virtual ErrorCode Execute(std::vector<std::string_view> &inputParameters) = 0;
 
     protected:
         Mysh *mysh;
@@ -76,541 +200,5921 @@ class Mysh {
             mysh = nullptr;
             allowCustomParameters = false;
         }
+
+    public:
+        virtual ~Command() = default;
     };
 
-    class HistoryHandler {
-        class History : public Command {
-        public:
-            explicit History(Mysh *mysh, HistoryHandler *inputHistory) {
-                keyword = "history";
-                validParameters = {"-c"};
-                this->allowCustomParameters = false;
-                this->mysh = mysh;
-                this->inputHistory = inputHistory;
+    /**
+     * Owns every Command and resolves a keyword in constant time. Builtins land
+     * in the perfect hash table, anything else in a hash map. The first command
+     * registered for a keyword wins, later duplicates are rejected.
+     */
+    class CommandRegistry {
+    public:
+        template<class C, class... Args>
+        C *Register(Args &&... args) {
+            auto command = std::make_unique<C>(std::forward<Args>(args)...);
+            C *registered = command.get();
+
+            if (Find(command->keyword) != nullptr) {
+                std::cerr << "command " << command->keyword << " is already registered" << std::endl;
+                return nullptr;
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
+            size_t slot = BuiltinSlot(command->keyword);
+            if (IsBuiltinKeyword(command->keyword))
+                builtinSlots[slot] = registered;
+            else
+                runtimeCommands.emplace(command->keyword, registered);
 
-                for (const auto &parameter : inputParameters) {
-                    if (parameter == "-c")
-                        inputHistory->ClearInputHistoryLines();
-                }
+            owned.push_back(std::move(command));
+            return registered;
+        }
 
-                inputHistory->PrintInputHistoryLines();
-                return no_error;
-            }
+        Command *Find(std::string_view keyword) const {
+            Command *command = builtinSlots[BuiltinSlot(keyword)];
+            if (command != nullptr && command->keyword == keyword)
+                return command;
 
-        private:
-            HistoryHandler *inputHistory;
-        };
+            if (runtimeCommands.empty())
+                return nullptr;
 
-    public:
-        explicit HistoryHandler(Mysh *mysh) {
-            this->mysh = mysh;
-            mysh->commands->push_back(new History(mysh, this));
+            auto it = runtimeCommands.find(keyword);
+            return it != runtimeCommands.end() ? it->second : nullptr;
         }
 
-        ~HistoryHandler() {
-            this->ClearInputHistoryLines();
+    private:
+        std::array<Command *, BUILTIN_TABLE_SIZE> builtinSlots{};
+        // Keys view the keyword owned by the Command
+        std::unordered_map<std::string_view, Command *> runtimeCommands;
+        std::vector<std::unique_ptr<Command>> owned;
+
+        static size_t BuiltinSlot(std::string_view keyword) {
+            return HashKeyword(keyword, BUILTIN_KEYWORD_SEED) & (BUILTIN_TABLE_SIZE - 1);
         }
 
-        void UpdateInputHistory(const std::string &inputLine) {
-            this->inputHistory.push_back(inputLine);
+        static bool IsBuiltinKeyword(std::string_view keyword) {
+            for (auto builtin : BUILTIN_KEYWORDS) {
+                if (builtin == keyword)
+                    return true;
+            }
+            return false;
         }
+    };
 
-    private:
-        Mysh *mysh;
-        std::vector<std::string> inputHistory;
+public:
+    /**
+     * Hands out input lines as views into one large buffer. Reads the fd in
+     * big blocks, or maps a whole script file, so batch input costs no
+     * allocation or syscall per line. A view is valid until the next call.
+     */
+    class LineReader {
+    public:
+        explicit LineReader(int fd) {
+            this->fd = fd;
+            interactive = isatty(fd);
+            storage.resize(BLOCKSIZE);
+            data = storage.data();
+        }
 
-        void ClearInputHistoryLines() {
-            inputHistory.clear();
+        explicit LineReader(const std::string &text) {
+            interactive = false;
+            atEof = true;
+            storage.assign(text.begin(), text.end());
+            data = storage.data();
+            end = storage.size();
         }
 
-        void PrintInputHistoryLines() {
-            for (const auto &line : inputHistory)
-                std::cout << "  " << line << std::endl;
+        ~LineReader() {
+            if (mapping != nullptr)
+                munmap(mapping, end);
+            if (ownsFd)
+                close(fd);
         }
-    };
 
-    class ExitHandler {
-        class Exit : public Command {
-        public:
-            explicit Exit(Mysh *mysh, ExitHandler *exitHandler) {
-                this->keyword = "byebye";
-                this->validParameters = {};
-                this->allowCustomParameters = false;
-                this->mysh = mysh;
-                this->exitHandler = exitHandler;
+        static LineReader *FromFile(const std::string &path) {
+            int scriptFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (scriptFd < 0)
+                return nullptr;
+
+            auto *reader = new LineReader(scriptFd);
+            reader->interactive = false;
+            reader->ownsFd = true;
+
+            struct stat st{};
+            if (fstat(scriptFd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, scriptFd, 0);
+                if (map != MAP_FAILED) {
+                    madvise(map, st.st_size, MADV_SEQUENTIAL);
+                    reader->mapping = map;
+                    reader->data = static_cast<char *>(map);
+                    reader->end = st.st_size;
+                    reader->atEof = true;
+                }
             }
+            return reader;
+        }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                int running = mysh->processHandler->CountRunningProcesses();
+        bool IsInteractive() const {
+            return interactive;
+        }
 
-                if (running > 0) {
-                    std::cout << "There are " << running << " active jobs" << std::endl;
+        int Fd() const {
+            return fd;
+        }
 
-                    std::cout << "terminate before exit? (y/n)";
-                    std::string input;
-                    std::cin >> input;
-                    // A bit ugly, but I want to avoid making KillAll() public,
-                    // so all this following code is to run it
-                    if (input == "y" or input == "yes") {
-                        input = "exterminateall";
-                        std::vector<std::string> vs = {};
-                        for (auto command : *mysh->commands) {
-                            if (command->keyword == input) {
-                                command->Execute(vs);
-                                break;
-                            }
-                        }
-                        return request_exit;
-                    }
-                    else if (input == "n" or input == "no") {
-                        return request_exit;
-                    }
+        // True if NextLine can answer without reading
+        bool HasLine() const {
+            return atEof || memchr(data + begin, '\n', end - begin) != nullptr;
+        }
 
-                    return no_error;
+        bool NextLine(std::string_view &line) {
+            while (true) {
+                auto *newline = static_cast<char *>(memchr(data + begin, '\n', end - begin));
+                if (newline != nullptr) {
+                    size_t lineEnd = newline - data;
+                    line = std::string_view(data + begin, lineEnd - begin);
+                    begin = lineEnd + 1;
+                    return true;
                 }
 
-                return request_exit;
+                if (atEof) {
+                    if (begin == end)
+                        return false;
+                    // Last line without a trailing newline
+                    line = std::string_view(data + begin, end - begin);
+                    begin = end;
+                    return true;
+                }
+
+                Fill();
             }
+        }
 
-        private:
-            ExitHandler *exitHandler;
-        };
+        // One read() worth of input
+        void Fill() {
+            // Move the unfinished line to the front, grow if it fills the buffer
+            if (begin > 0) {
+                memmove(data, data + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if (end == storage.size()) {
+                storage.resize(storage.size() * 2);
+                data = storage.data();
+            }
 
-    public:
-        explicit ExitHandler(Mysh *mysh) {
-            this->mysh = mysh;
-            mysh->commands->push_back(new Exit(mysh, this));
-        }
+            ssize_t n;
+            do {
+                n = read(fd, data + end, storage.size() - end);
+            } while (n < 0 && errno == EINTR);
 
-        ~ExitHandler() = default;
+            if (n < 0 && errno == EAGAIN)
+                return;
+
+            if (n <= 0)
+                atEof = true;
+            else
+                end += n;
+        }
 
     private:
-        Mysh *mysh;
+        static constexpr size_t BLOCKSIZE = 64 * 1024;
+
+        int fd = -1;
+        bool ownsFd = false;
+        bool interactive;
+        bool atEof = false;
+        void *mapping = nullptr;
+        std::vector<char> storage;
+        char *data;
+        size_t begin = 0;
+        size_t end = 0;
     };
 
-    class DirectoryHandler {
-        class WhereAmI : public Command {
-        public:
-            explicit WhereAmI(Mysh *mysh, DirectoryHandler *directoryHandler) {
-                this->keyword = "whereami";
-                this->validParameters = {};
-                this->allowCustomParameters = false;
-                this->mysh = mysh;
-                this->directoryHandler = directoryHandler;
-            }
+    /**
+     * Single-pass lexer. Splits on unquoted whitespace, honours '...' and "..."
+     * quoting and backslash escapes, and writes the unescaped text into a
+     * reused buffer. Tokens are views into that buffer, each NUL-terminated,
+     * and stay valid until the next Tokenize call.
+     *
+     * An unquoted operator such as | becomes its own token viewing OPERATORS
+     * instead of the buffer, so IsOperator can tell it from a quoted "|".
+     */
+    class Tokenizer {
+    public:
+        static constexpr std::string_view PIPE = "|";
+        static constexpr std::string_view INPUT = "<";
+        static constexpr std::string_view OUTPUT = ">";
+        static constexpr std::string_view APPEND = ">>";
+        static constexpr std::string_view ERROR = "2>";
+        static constexpr std::string_view ERROR_TO_OUTPUT = "2>&1";
+        static constexpr std::string_view OPERATORS[] = {PIPE, INPUT, OUTPUT, APPEND, ERROR, ERROR_TO_OUTPUT};
+
+        std::vector<std::string_view> tokens;
+
+        static bool IsOperator(std::string_view token, std::string_view op) {
+            return token.data() == op.data();
+        }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                directoryHandler->PrintCurrentDirectory();
-                return no_error;
+        static bool IsOperator(std::string_view token) {
+            for (auto op : OPERATORS) {
+                if (token.data() == op.data())
+                    return true;
             }
+            return false;
+        }
 
-        private:
-            DirectoryHandler *directoryHandler;
-        };
+        // Returns false on an unterminated quote
+        bool Tokenize(std::string_view line) {
+            tokens.clear();
 
-        class MoveToDirectory : public Command {
-        public:
-            explicit MoveToDirectory(Mysh *mysh, DirectoryHandler *directoryHandler) {
-                this->keyword = "movetodir";
-                this->validParameters = {};
-                this->allowCustomParameters = true;
-                this->mysh = mysh;
-                this->directoryHandler = directoryHandler;
+            // Unescaped text is never longer than the line, plus one NUL per
+            // token, so the buffer never moves while tokens point into it
+            if (buffer.size() < 2 * line.size() + 1)
+                buffer.resize(2 * line.size() + 1);
+
+            char *out = buffer.data();
+            char *tokenStart = nullptr;
+            size_t i = 0;
+            const size_t n = line.size();
+
+            while (i < n) {
+                char c = line[i];
+
+                if (IsSpace(c)) {
+                    if (tokenStart != nullptr) {
+                        EndToken(tokenStart, out);
+                        tokenStart = nullptr;
+                    }
+                    i++;
+                    continue;
+                }
+
+                std::string_view op = MatchOperator(line.substr(i), tokenStart == nullptr);
+                if (!op.empty()) {
+                    if (tokenStart != nullptr) {
+                        EndToken(tokenStart, out);
+                        tokenStart = nullptr;
+                    }
+                    tokens.push_back(op);
+                    i += op.size();
+                    continue;
+                }
+
+                if (tokenStart == nullptr)
+                    tokenStart = out;
+
+                if (c == '\\') {
+                    // A trailing backslash stays literal
+                    *out++ = (i + 1 < n) ? line[++i] : c;
+                    i++;
+                } else if (c == '\'') {
+                    size_t close = line.find('\'', i + 1);
+                    if (close == std::string_view::npos)
+                        return false;
+                    memcpy(out, line.data() + i + 1, close - i - 1);
+                    out += close - i - 1;
+                    i = close + 1;
+                } else if (c == '"') {
+                    i++;
+                    while (i < n && line[i] != '"') {
+                        // Inside double quotes only these may be escaped
+                        if (line[i] == '\\' && i + 1 < n &&
+                            (line[i + 1] == '"' || line[i + 1] == '\\' || line[i + 1] == '$' || line[i + 1] == '`'))
+                            i++;
+                        *out++ = line[i++];
+                    }
+                    if (i == n)
+                        return false;
+                    i++;
+                } else {
+                    *out++ = c;
+                    i++;
+                }
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                if (inputParameters.empty())
-                    return incorrect_parameters;
+            if (tokenStart != nullptr)
+                EndToken(tokenStart, out);
 
-                std::string inputPath = inputParameters[0];
+            return true;
+        }
 
-                ErrorCode ec = directoryHandler->ChangeCurrentDirectory(inputPath);
+    private:
+        std::string buffer;
 
-                return ec;
+        static bool IsSpace(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+        }
+
+        // The operator rest starts with, if any. 2> only counts at the start of a word
+        static std::string_view MatchOperator(std::string_view rest, bool atWordStart) {
+            switch (rest[0]) {
+                case '|':
+                    return PIPE;
+                case '<':
+                    return INPUT;
+                case '>':
+                    return rest.substr(0, 2) == APPEND ? APPEND : OUTPUT;
+                case '2':
+                    if (!atWordStart)
+                        return {};
+                    if (rest.substr(0, 4) == ERROR_TO_OUTPUT)
+                        return ERROR_TO_OUTPUT;
+                    if (rest.substr(0, 2) == ERROR)
+                        return ERROR;
+                    return {};
+                default:
+                    return {};
             }
+        }
 
-        private:
-            DirectoryHandler *directoryHandler;
-        };
+        void EndToken(char *tokenStart, char *&out) {
+            tokens.emplace_back(tokenStart, out - tokenStart);
+            *out++ = '\0';
+        }
+    };
 
+    /**
+     * epoll based dispatcher. Anything the shell waits on (stdin, child exits)
+     * registers an fd with a handler, and the shell blocks in one place.
+     */
+    class EventLoop {
     public:
-        explicit DirectoryHandler(Mysh *mysh) {
-            this->mysh = mysh;
-            BUFFERSIZE = 1024;
-            currentDirectory = new char[BUFFERSIZE];
+        using Handler = std::function<void(uint32_t events)>;
 
-            if (!getcwd(currentDirectory, BUFFERSIZE)) {
-                perror("Error getting current directory");
-            }
+        EventLoop() {
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (epollFd == -1)
+                perror("epoll_create1");
+        }
 
-            mysh->commands->push_back(new WhereAmI(mysh, this));
-            mysh->commands->push_back(new MoveToDirectory(mysh, this));
+        ~EventLoop() {
+            if (epollFd != -1)
+                close(epollFd);
         }
 
-        ~DirectoryHandler() {
-            delete[] currentDirectory;
+        // Fails for fds epoll cannot watch, such as regular files
+        bool Add(int fd, uint32_t events, Handler handler) {
+            struct epoll_event event{};
+            event.events = events;
+            event.data.fd = fd;
+
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+                return false;
+
+            handlers[fd] = std::move(handler);
+            return true;
         }
 
-        std::string GetCurrentDirectoryString() {
-            return std::string(this->currentDirectory);
+        void Remove(int fd) {
+            if (handlers.erase(fd) > 0)
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
         }
 
-    private:
-        Mysh *mysh;
-        int BUFFERSIZE;
-        char *currentDirectory;
+        // Waits up to timeoutMs (-1 for no limit) and runs the ready handlers
+        int RunOnce(int timeoutMs) {
+            struct epoll_event events[MAXEVENTS];
 
-        void PrintCurrentDirectory() const {
-            std::cout << currentDirectory << std::endl;
+            int n = epoll_wait(epollFd, events, MAXEVENTS, timeoutMs);
+            if (n == -1 && errno != EINTR)
+                perror("epoll_wait");
+
+            for (int i = 0; i < n; i++) {
+                auto it = handlers.find(events[i].data.fd);
+                // A previous handler may have removed this fd
+                if (it == handlers.end())
+                    continue;
+                Handler handler = it->second;
+                handler(events[i].events);
+            }
+            return n;
         }
 
-        ErrorCode ChangeCurrentDirectory(std::string &inputPath) {
-            ErrorCode errorCode = no_error;
+    private:
+        static constexpr int MAXEVENTS = 64;
 
-            char *pathname = new char[BUFFERSIZE];
-            strcpy(pathname, inputPath.c_str());
+        int epollFd;
+        std::unordered_map<int, Handler> handlers;
+    };
+
+    /**
+     * Log-linear histogram of non-negative integers, HDR style: exact below 32,
+     * then 16 buckets per power of two, so any percentile is within ~6%.
+     * Fixed size, recording is a few instructions and no allocation.
+     */
+    class Histogram {
+    public:
+        void Record(uint64_t value) {
+            counts[Bucket(value)]++;
+            total++;
+            if (value > maximum)
+                maximum = value;
+        }
 
-            if (chdir(pathname) == 0) {
-                if (!getcwd(pathname, BUFFERSIZE)) {
-                    perror("Error getting current directory");
+        // Midpoint of the bucket holding the given percentile, 0 when empty
+        uint64_t Percentile(double percentile) const {
+            if (total == 0)
+                return 0;
+
+            uint64_t rank = (uint64_t) (percentile / 100.0 * (double) total + 0.5);
+            if (rank < 1)
+                rank = 1;
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    // The top bucket ends at UINT64_MAX, a plain sum would overflow
+                    uint64_t low = LowerBound(i), high = LowerBound(i + 1);
+                    return std::min(low + (high - low) / 2, maximum);
                 }
-                std::strcpy(currentDirectory, pathname);
-            } else {
-                errorCode = dir_does_not_exist;
             }
+            return maximum;
+        }
+
+        uint64_t Count() const {
+            return total;
+        }
+
+        uint64_t Max() const {
+            return maximum;
+        }
+
+        void Clear() {
+            counts.fill(0);
+            total = 0;
+            maximum = 0;
+        }
 
-            delete[] pathname;
-            return errorCode;
+    private:
+        static constexpr size_t LINEAR = 32;
+        static constexpr size_t SUBBUCKETS = 16;
+        static constexpr size_t BUCKETS = LINEAR + (64 - 5) * SUBBUCKETS;
+
+        std::array<uint64_t, BUCKETS> counts{};
+        uint64_t total = 0;
+        uint64_t maximum = 0;
+
+        static size_t Bucket(uint64_t value) {
+            if (value < LINEAR)
+                return value;
+            int msb = 63 - __builtin_clzll(value);
+            return LINEAR + (msb - 5) * SUBBUCKETS + ((value >> (msb - 4)) & (SUBBUCKETS - 1));
+        }
+
+        static uint64_t LowerBound(size_t bucket) {
+            if (bucket < LINEAR)
+                return bucket;
+            size_t msb = (bucket - LINEAR) / SUBBUCKETS + 5;
+            uint64_t sub = (bucket - LINEAR) % SUBBUCKETS;
+            if (msb >= 64)
+                return UINT64_MAX;
+            return (SUBBUCKETS + sub) << (msb - 4);
         }
     };
 
-    class ProcessHandler {
-        class RunForeground : public Command {
+private:
+
+    /**
+     * Command history: the last few entries live in a fixed-size ring, every
+     * entry is appended to a log file that survives the session. Each log
+     * line is "<epoch seconds> <exit status>\t<command>". On startup the log
+     * is mmapped and only its tail is parsed into the ring.
+     */
+    class HistoryHandler {
+        class History : public Command {
         public:
-            explicit RunForeground(Mysh *mysh, ProcessHandler *ph) {
-                this->mysh = mysh;
-                this->processHandler = ph;
-                this->keyword = "run";
-                this->validParameters = {};
+            explicit History(Mysh *mysh, HistoryHandler *inputHistory) {
+                keyword = "history";
+                validParameters = {"-c", "-s", "-e"};
                 this->allowCustomParameters = true;
+                this->mysh = mysh;
+                this->inputHistory = inputHistory;
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-
-                if (inputParameters.empty())
-                    return incorrect_parameters;
-
-                char **arguments = InputParametersToCharArguments(inputParameters);
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.size() == 2 && (inputParameters[0] == "-s" || inputParameters[0] == "-e"))
+                    return inputHistory->SearchInputHistory(inputParameters[1], inputParameters[0] == "-e");
 
-                ErrorCode ec = Mysh::ProcessHandler::ForkExecWait(arguments);
+                for (const auto &parameter : inputParameters) {
+                    if (parameter != "-c")
+                        return incorrect_parameters;
+                }
 
-                for (long unsigned i = 0; i < inputParameters.size() + 1; i++)
-                    delete[] arguments[i];
-                delete[] arguments;
+                if (!inputParameters.empty())
+                    inputHistory->ClearInputHistoryLines();
 
-                return ec;
+                inputHistory->PrintInputHistoryLines();
+                return no_error;
             }
 
         private:
-            ProcessHandler *processHandler;
+            HistoryHandler *inputHistory;
         };
 
-        class RunBackground : public Command {
+        /**
+         * Trigram index over every history record, built on the first search
+         * and extended as entries finish. Records are kept in log format in one
+         * arena, each trigram maps to the ascending list of records holding it,
+         * so a query intersects a few short lists and verifies the survivors.
+         */
+        class HistoryIndex {
         public:
-            explicit RunBackground(Mysh *mysh, ProcessHandler *ph) {
-                this->mysh = mysh;
-                this->processHandler = ph;
-                this->keyword = "background";
-                this->validParameters = {};
-                this->allowCustomParameters = true;
+            void Add(std::string_view record) {
+                auto id = (uint32_t) (starts.size() - 1);
+                text.append(record);
+                starts.push_back(text.size());
+
+                std::string_view command = Command(id);
+                for (size_t i = 0; i + 3 <= command.size(); i++) {
+                    std::vector<uint32_t> &records = postings[Trigram(command.data() + i)];
+                    // Records arrive in order, so a repeat within one is always last
+                    if (records.empty() || records.back() != id)
+                        records.push_back(id);
+                }
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                if (inputParameters.empty())
-                    return incorrect_parameters;
+            void Reserve(size_t bytes) {
+                text.reserve(bytes);
+            }
 
-                char **arguments = InputParametersToCharArguments(inputParameters);
+            size_t Size() const {
+                return starts.size() - 1;
+            }
+
+            std::string_view Record(size_t id) const {
+                return std::string_view(text).substr(starts[id], starts[id + 1] - starts[id]);
+            }
 
-                pid_t pid;
-                ErrorCode ec = Mysh::ProcessHandler::ForkExecBackground(arguments, &pid);
+            std::string_view Command(size_t id) const {
+                std::string_view record = Record(id);
+                size_t tab = record.find('\t');
+                return tab == std::string_view::npos ? std::string_view() : record.substr(tab + 1);
+            }
 
-                if (pid > 0) {
-                    printf("child (pid:%ld)\n", (long) pid);
-                    processHandler->AddBackgroundPID(pid);
+            // Records that contain every literal; all records if there is nothing to narrow by
+            void Candidates(const std::vector<std::string> &literals, std::vector<uint32_t> &out) const {
+                std::vector<const std::vector<uint32_t> *> lists;
+                for (const auto &literal : literals) {
+                    for (size_t i = 0; i + 3 <= literal.size(); i++) {
+                        auto it = postings.find(Trigram(literal.data() + i));
+                        if (it == postings.end()) {
+                            out.clear();
+                            return;
+                        }
+                        lists.push_back(&it->second);
+                    }
                 }
 
-                for (long unsigned i = 0; i < inputParameters.size() + 1; i++)
-                    delete[] arguments[i];
-                delete[] arguments;
+                out.clear();
+                if (lists.empty()) {
+                    for (uint32_t id = 0; id < Size(); id++)
+                        out.push_back(id);
+                    return;
+                }
 
-                return ec;
+                // Start from the rarest trigram and binary search the rest, so common
+                // trigrams with a million records cost a few probes per candidate
+                std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+                out = *lists[0];
+                for (size_t i = 1; i < lists.size() && !out.empty(); i++) {
+                    auto from = lists[i]->begin();
+                    size_t kept = 0;
+                    for (uint32_t id : out) {
+                        from = std::lower_bound(from, lists[i]->end(), id);
+                        if (from == lists[i]->end())
+                            break;
+                        if (*from == id)
+                            out[kept++] = id;
+                    }
+                    out.resize(kept);
+                }
+            }
+
+        private:
+            std::string text;
+            std::vector<size_t> starts{0};
+            std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+
+            static uint32_t Trigram(const char *p) {
+                return (uint32_t) (unsigned char) p[0] << 16 | (uint32_t) (unsigned char) p[1] << 8 |
+                       (unsigned char) p[2];
+            }
+        };
+
+    public:
+        explicit HistoryHandler(Mysh *mysh) {
+            this->mysh = mysh;
+            mysh->commands.Register<History>(mysh, this);
+
+            long capacity;
+            const char *size = getenv("MYSH_HISTSIZE");
+            if (size == nullptr || !ParseNumber(size, capacity) || capacity < 1)
+                capacity = DEFAULT_CAPACITY;
+            ring.resize(capacity);
+
+            // Only interactive sessions keep a log, scripts would flood it
+            if (mysh->input->IsInteractive())
+                OpenLog();
+        }
+
+        ~HistoryHandler() {
+            if (logFd != -1)
+                close(logFd);
+        }
+
+        // Records a line before it runs, so history lists itself
+        void UpdateInputHistory(std::string_view inputLine) {
+            if (inputLine.find_first_not_of(" \t\r") == std::string_view::npos) {
+                pending = false;
+                return;
+            }
+
+            Entry &entry = ring[(first + count) % ring.size()];
+            if (count < ring.size())
+                count++;
+            else
+                first = (first + 1) % ring.size();
+
+            entry.number = ++lastNumber;
+            entry.time = time(nullptr);
+            entry.status = -1;
+            entry.line.assign(inputLine);
+            pending = true;
+        }
+
+        // Completes the newest entry with its exit status and appends it to the log
+        void FinishInputHistory(int status) {
+            if (!pending)
+                return;
+            pending = false;
+
+            Entry &entry = ring[(first + count - 1) % ring.size()];
+            entry.status = status;
+
+            char prefix[48];
+            int length = snprintf(prefix, sizeof(prefix), "%ld %d\t", (long) entry.time, status);
+
+            if (index != nullptr)
+                index->Add(std::string(prefix, length) + entry.line);
+
+            if (logFd == -1)
+                return;
+
+            struct iovec parts[] = {
+                    {prefix, (size_t) length},
+                    {const_cast<char *>(entry.line.data()), entry.line.size()},
+                    {const_cast<char *>("\n"), 1},
+            };
+            // One O_APPEND write per entry, concurrent shells never interleave lines
+            if (writev(logFd, parts, 3) == -1)
+                perror("history");
+        }
+
+        // Resolves "!N" and "!!" to the recorded command, false if there is no such entry
+        bool ExpandInputHistory(std::string_view inputLine, std::string &expanded) {
+            long number;
+            if (inputLine == "!!") {
+                number = count > 0 ? ring[(first + count - 1) % ring.size()].number : lastNumber;
+            } else if (!ParseNumber(inputLine.substr(1), number)) {
+                return false;
+            }
+
+            // Numbers rise through the ring but skip malformed log lines, so they are searched
+            if (count > 0 && number >= ring[first].number && number <= lastNumber) {
+                size_t low = 0, high = count;
+                while (low < high) {
+                    size_t middle = low + (high - low) / 2;
+                    if (ring[(first + middle) % ring.size()].number < number)
+                        low = middle + 1;
+                    else
+                        high = middle;
+                }
+                const Entry &entry = ring[(first + low) % ring.size()];
+                if (low < count && entry.number == number) {
+                    expanded = entry.line;
+                    return true;
+                }
+            }
+
+            HistoryIndex &searchIndex = Index();
+            if (number < indexFirstNumber || number - indexFirstNumber >= (long) searchIndex.Size())
+                return false;
+            expanded = searchIndex.Command(number - indexFirstNumber);
+            return !expanded.empty();
+        }
+
+    private:
+        static constexpr long DEFAULT_CAPACITY = 1000;
+
+        struct Entry {
+            long number = 0;
+            time_t time = 0;
+            int status = -1;
+            std::string line;
+        };
+
+        Mysh *mysh;
+        std::vector<Entry> ring;
+        size_t first = 0;
+        size_t count = 0;
+        long lastNumber = 0;
+        bool pending = false;
+        int logFd = -1;
+        std::unique_ptr<HistoryIndex> index;
+        long indexFirstNumber = 1;
+
+        void OpenLog() {
+            std::string path;
+            const char *file = getenv("MYSH_HISTFILE");
+            if (file != nullptr) {
+                path = file;
+            } else {
+                const char *home = getenv("HOME");
+                if (home == nullptr)
+                    return;
+                path = std::string(home) + "/.mysh_history";
+            }
+            if (path.empty())
+                return;
+
+            logFd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+            if (logFd == -1) {
+                std::cerr << "history: " << path << ": " << strerror(errno) << std::endl;
+                return;
+            }
+            LoadLog();
+        }
+
+        void LoadLog() {
+            struct stat st{};
+            if (fstat(logFd, &st) == -1 || st.st_size == 0)
+                return;
+
+            size_t size = st.st_size;
+            void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, logFd, 0);
+            if (map == MAP_FAILED) {
+                perror("history: mmap");
+                return;
+            }
+            const char *data = static_cast<const char *>(map);
+            const char *end = data + size;
+
+            // A torn last line from a crashed shell is ignored
+            while (end > data && end[-1] != '\n')
+                end--;
+
+            // Numbers continue from the log, counting lines is a memchr sweep
+            long lines = 0;
+            for (const char *p = data; (p = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr; p++)
+                lines++;
+
+            // Walk back over just enough lines to fill the ring
+            const char *tail = end;
+            size_t wanted = std::min<size_t>(lines, ring.size());
+            for (size_t i = 0; i < wanted; i++) {
+                const char *newline = static_cast<const char *>(memrchr(data, '\n', tail - 1 - data));
+                tail = newline != nullptr ? newline + 1 : data;
+            }
+
+            lastNumber = lines - (long) wanted;
+            for (const char *p = tail; p < end;) {
+                const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+                ParseLogLine(std::string_view(p, newline - p));
+                p = newline + 1;
+            }
+
+            munmap(map, size);
+        }
+
+        void ParseLogLine(std::string_view text) {
+            long when, status;
+            std::string_view command;
+            if (!SplitRecord(text, when, status, command)) {
+                lastNumber++;
+                return;
+            }
+
+            UpdateInputHistory(command);
+            Entry &entry = ring[(first + count - 1) % ring.size()];
+            entry.time = when;
+            entry.status = (int) status;
+            pending = false;
+        }
+
+        static bool SplitRecord(std::string_view record, long &when, long &status, std::string_view &command) {
+            size_t tab = record.find('\t');
+            size_t space = record.find(' ');
+            if (tab == std::string_view::npos || space > tab ||
+                !ParseNumber(record.substr(0, space), when) ||
+                !ParseNumber(record.substr(space + 1, tab - space - 1), status))
+                return false;
+            command = record.substr(tab + 1);
+            return true;
+        }
+
+        // Builds the search index from the whole log, or from the ring when there is no log
+        HistoryIndex &Index() {
+            if (index != nullptr)
+                return *index;
+
+            index = std::make_unique<HistoryIndex>();
+            struct stat st{};
+            if (logFd != -1 && fstat(logFd, &st) == 0 && st.st_size > 0) {
+                size_t size = st.st_size;
+                void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, logFd, 0);
+                if (map != MAP_FAILED) {
+                    const char *data = static_cast<const char *>(map);
+                    const char *end = data + size;
+                    index->Reserve(size);
+                    for (const char *p = data; p < end;) {
+                        auto *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+                        if (newline == nullptr)
+                            break;
+                        index->Add(std::string_view(p, newline - p));
+                        p = newline + 1;
+                    }
+                    munmap(map, size);
+                }
+                indexFirstNumber = 1;
+                return *index;
+            }
+
+            indexFirstNumber = count > 0 ? ring[first].number : lastNumber + 1;
+            char prefix[48];
+            for (size_t i = 0; i < count; i++) {
+                const Entry &entry = ring[(first + i) % ring.size()];
+                if (entry.status < 0)
+                    break;
+                snprintf(prefix, sizeof(prefix), "%ld %d\t", (long) entry.time, entry.status);
+                index->Add(prefix + entry.line);
+            }
+            return *index;
+        }
+
+        // Substrings of the regex every match has to contain, to narrow by trigram
+        static std::vector<std::string> RequiredLiterals(std::string_view pattern) {
+            std::vector<std::string> literals;
+            if (pattern.find('|') != std::string_view::npos)
+                return literals;
+
+            std::string run;
+            std::vector<size_t> groups;
+            auto endRun = [&]() {
+                if (run.size() >= 3)
+                    literals.push_back(run);
+                run.clear();
+            };
+
+            for (size_t i = 0; i < pattern.size(); i++) {
+                char c = pattern[i];
+                if (c == '?' || c == '*' || c == '{') {
+                    // The quantifier makes the character before it optional
+                    if (!run.empty())
+                        run.pop_back();
+                    endRun();
+                    if (c == '{')
+                        i = std::min(pattern.find('}', i), pattern.size());
+                } else if (c == '[') {
+                    endRun();
+                    i = std::min(pattern.find(']', i + 2), pattern.size());
+                } else if (c == '(') {
+                    endRun();
+                    groups.push_back(literals.size());
+                } else if (c == ')') {
+                    endRun();
+                    // An optional group requires none of what was inside it
+                    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+                    if (!groups.empty() && (next == '?' || next == '*' || next == '{'))
+                        literals.resize(groups.back());
+                    if (!groups.empty())
+                        groups.pop_back();
+                } else if (c == '\\' || c == '.' || c == '^' || c == '$' || c == '+') {
+                    // "a+" still requires the a, everything else ends the run
+                    if (c == '+') {
+                        std::string kept = run;
+                        endRun();
+                        if (!kept.empty())
+                            run = kept.substr(kept.size() - 1);
+                        continue;
+                    }
+                    endRun();
+                    if (c == '\\')
+                        i++;
+                } else {
+                    run += c;
+                }
+            }
+            endRun();
+            return literals;
+        }
+
+        ErrorCode SearchInputHistory(std::string_view pattern, bool isRegex) {
+            std::regex expression;
+            std::vector<std::string> literals;
+            if (isRegex) {
+                try {
+                    expression = std::regex(pattern.begin(), pattern.end(), std::regex::ECMAScript | std::regex::optimize);
+                } catch (const std::regex_error &e) {
+                    std::cerr << "history: bad pattern: " << e.what() << std::endl;
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+                literals = RequiredLiterals(pattern);
+            } else {
+                literals.emplace_back(pattern);
+            }
+
+            HistoryIndex &searchIndex = Index();
+            std::vector<uint32_t> candidates;
+            searchIndex.Candidates(literals, candidates);
+
+            std::string out;
+            for (uint32_t id : candidates) {
+                std::string_view command = searchIndex.Command(id);
+                bool matched = isRegex ? std::regex_search(command.begin(), command.end(), expression)
+                                       : command.find(pattern) != std::string_view::npos;
+                if (!matched)
+                    continue;
+
+                long when, status;
+                SplitRecord(searchIndex.Record(id), when, status, command);
+                FormatEntry(out, indexFirstNumber + id, (time_t) when, (int) status, command);
+            }
+
+            std::cout << out << std::flush;
+            return no_error;
+        }
+
+        static void FormatEntry(std::string &out, long number, time_t when, int status, std::string_view line) {
+            char prefix[64];
+            struct tm local{};
+            localtime_r(&when, &local);
+            int length = (int) strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+            if (status >= 0)
+                snprintf(prefix + length, sizeof(prefix) - length, "  %3d", status);
+            else
+                snprintf(prefix + length, sizeof(prefix) - length, "     ");
+
+            out += "  ";
+            out += std::to_string(number);
+            out += "  ";
+            out += prefix;
+            out += "  ";
+            out += line;
+            out += '\n';
+        }
+
+        void ClearInputHistoryLines() {
+            first = 0;
+            count = 0;
+            lastNumber = 0;
+            pending = false;
+            index.reset();
+            if (logFd != -1 && ftruncate(logFd, 0) == -1)
+                perror("history");
+        }
+
+        void PrintInputHistoryLines() {
+            std::string out;
+            out.reserve(count * 64);
+
+            for (size_t i = 0; i < count; i++) {
+                const Entry &entry = ring[(first + i) % ring.size()];
+                FormatEntry(out, entry.number, entry.time, entry.status, entry.line);
+            }
+
+            std::cout << out << std::flush;
+        }
+    };
+
+    class ExitHandler {
+        class Exit : public Command {
+        public:
+            explicit Exit(Mysh *mysh, ExitHandler *exitHandler) {
+                this->keyword = "byebye";
+                this->validParameters = {};
+                this->allowCustomParameters = false;
+                this->mysh = mysh;
+                this->exitHandler = exitHandler;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                int running = mysh->processHandler->CountRunningProcesses();
+
+                if (running > 0 && mysh->input->IsInteractive()) {
+                    std::cout << "There are " << running << " active jobs" << std::endl;
+
+                    std::cout << "terminate before exit? (y/n)" << std::flush;
+                    std::string_view answer;
+                    if (!mysh->input->NextLine(answer))
+                        return request_exit;
+                    std::string input(answer);
+                    // A bit ugly, but I want to avoid making KillAll() public,
+                    // so all this following code is to run it
+                    if (input == "y" or input == "yes") {
+                        std::vector<std::string_view> vs = {};
+                        mysh->commands.Find("exterminateall")->Execute(vs);
+                        return request_exit;
+                    }
+                    else if (input == "n" or input == "no") {
+                        return request_exit;
+                    }
+
+                    return no_error;
+                }
+
+                return request_exit;
+            }
+
+        private:
+            ExitHandler *exitHandler;
+        };
+
+    public:
+        explicit ExitHandler(Mysh *mysh) {
+            this->mysh = mysh;
+            mysh->commands.Register<Exit>(mysh, this);
+        }
+
+        ~ExitHandler() = default;
+
+    private:
+        Mysh *mysh;
+    };
+
+    /**
+     * Runs mysh scripts parsed once into a tree of statements, so loop bodies
+     * are never tokenized or looked up again. Besides commands a script has
+     *
+     *   set name word...          variables, expanded as {name} in any word
+     *   for i in 1..N / for x in a b c ... end
+     *   if [!] command ... [else ...] end      on the command's exit status
+     *   function name ... end     called like a command, arguments are {1}.., {#}
+     *
+     * and {?} for the last exit status. Commands resolve to their Command
+     * object at parse time and run through Mysh::ExecuteCommand; one made of
+     * literal words also has its parameters built and validated there.
+     */
+    class ScriptHandler {
+        class Source : public Command {
+        public:
+            explicit Source(Mysh *mysh, ScriptHandler *scriptHandler) {
+                this->keyword = "source";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+                this->mysh = mysh;
+                this->scriptHandler = scriptHandler;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.empty())
+                    return incorrect_parameters;
+
+                std::string path(inputParameters[0]);
+                LineReader *reader = LineReader::FromFile(path);
+                if (reader == nullptr) {
+                    perror(path.c_str());
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                std::vector<std::string> arguments(inputParameters.begin() + 1, inputParameters.end());
+                ErrorCode ec = scriptHandler->RunScript(*reader, path, arguments);
+                delete reader;
+                return ec;
+            }
+
+        private:
+            ScriptHandler *scriptHandler;
+        };
+
+    public:
+        explicit ScriptHandler(Mysh *mysh) {
+            this->mysh = mysh;
+            mysh->commands.Register<Source>(mysh, this);
+        }
+
+        ~ScriptHandler() = default;
+
+        // Parses all of input first, nothing runs if any line is malformed
+        ErrorCode RunScript(LineReader &input, const std::string &name, const std::vector<std::string> &arguments) {
+            if (depth >= MAX_DEPTH) {
+                std::cerr << name << ": scripts nested too deep" << std::endl;
+                mysh->lastStatus = 1;
+                return no_error;
+            }
+
+            Script script(mysh);
+            if (!script.Parse(input, name)) {
+                mysh->lastStatus = 1;
+                return no_error;
+            }
+
+            depth++;
+            ErrorCode ec = script.Run(arguments);
+            depth--;
+            return ec;
+        }
+
+    private:
+        static constexpr int MAX_DEPTH = 64;
+
+        Mysh *mysh;
+        int depth = 0;
+
+        class Script {
+        public:
+            explicit Script(Mysh *mysh) : mysh(mysh) {
+                statusSlot = Slot("?");
+                countSlot = Slot("#");
+            }
+
+            bool Parse(LineReader &input, const std::string &scriptName) {
+                name = scriptName;
+                std::vector<std::vector<Node> *> blocks = {&body};
+                std::vector<Node *> openers;
+
+                std::string_view line;
+                size_t lineNumber = 0;
+                while (input.NextLine(line)) {
+                    lineNumber++;
+                    if (!tokenizer.Tokenize(line))
+                        return Error(lineNumber, "unterminated quote");
+
+                    std::vector<std::string_view> &tokens = tokenizer.tokens;
+                    if (tokens.empty() || tokens[0][0] == '#')
+                        continue;
+
+                    std::string_view keyword = tokens[0];
+                    std::vector<Node> &block = *blocks.back();
+
+                    if (keyword == "end") {
+                        if (openers.empty() || tokens.size() != 1)
+                            return Error(lineNumber, "unexpected end");
+                        openers.pop_back();
+                        blocks.pop_back();
+                        continue;
+                    }
+
+                    if (keyword == "else") {
+                        if (openers.empty() || openers.back()->kind != if_status || openers.back()->hasElse ||
+                            tokens.size() != 1)
+                            return Error(lineNumber, "else without if");
+                        openers.back()->hasElse = true;
+                        blocks.back() = &openers.back()->elseBody;
+                        continue;
+                    }
+
+                    Node &node = block.emplace_back();
+                    node.line = lineNumber;
+
+                    if (keyword == "set") {
+                        if (tokens.size() < 2 || !IsName(tokens[1]))
+                            return Error(lineNumber, "usage: set name word...");
+                        node.kind = assign;
+                        node.slot = Slot(tokens[1]);
+                        for (size_t i = 2; i < tokens.size(); i++)
+                            node.words.push_back(ParseWord(tokens[i]));
+                    } else if (keyword == "for") {
+                        if (tokens.size() < 4 || !IsName(tokens[1]) || tokens[2] != "in")
+                            return Error(lineNumber, "usage: for name in A..B | word...");
+                        node.slot = Slot(tokens[1]);
+                        size_t dots = tokens[3].find("..");
+                        if (tokens.size() == 4 && dots != std::string_view::npos) {
+                            node.kind = for_range;
+                            node.words.push_back(ParseWord(tokens[3].substr(0, dots)));
+                            node.words.push_back(ParseWord(tokens[3].substr(dots + 2)));
+                        } else {
+                            node.kind = for_list;
+                            for (size_t i = 3; i < tokens.size(); i++)
+                                node.words.push_back(ParseWord(tokens[i]));
+                        }
+                        openers.push_back(&node);
+                        blocks.push_back(&node.body);
+                    } else if (keyword == "if") {
+                        size_t first = 1;
+                        node.kind = if_status;
+                        if (tokens.size() > 1 && tokens[1] == "!") {
+                            node.negate = true;
+                            first = 2;
+                        }
+                        if (first == tokens.size())
+                            return Error(lineNumber, "usage: if [!] command");
+                        node.condition = std::make_unique<Node>();
+                        node.condition->line = lineNumber;
+                        ParseCommand(*node.condition, tokens, first);
+                        openers.push_back(&node);
+                        blocks.push_back(&node.body);
+                    } else if (keyword == "function") {
+                        if (tokens.size() != 2 || openers.size() > 0)
+                            return Error(lineNumber, "usage: function name, at the top level");
+                        node.kind = function_definition;
+                        node.words.push_back(ParseWord(tokens[1]));
+                        openers.push_back(&node);
+                        blocks.push_back(&node.body);
+                    } else {
+                        ParseCommand(node, tokens, 0);
+                    }
+                }
+
+                if (!openers.empty())
+                    return Error(openers.back()->line, "missing end");
+
+                // Functions may be defined after their first use, and the nodes only stop moving now
+                for (Node &node : body) {
+                    if (node.kind == function_definition)
+                        functions[std::string(node.words[0].pieces[0].text)] = &node;
+                }
+                ResolveCalls(body);
+                return true;
+            }
+
+            ErrorCode Run(const std::vector<std::string> &arguments) {
+                SetArguments(arguments);
+                return RunBlock(body);
+            }
+
+        private:
+            enum NodeKind {
+                command,
+                assign,
+                for_range,
+                for_list,
+                if_status,
+                function_definition,
+            };
+
+            // Literal text, or the variable in slot
+            struct Piece {
+                std::string_view text;
+                int slot = -1;
+            };
+
+            struct Word {
+                std::vector<Piece> pieces;
+                bool IsLiteral() const {
+                    return pieces.size() == 1 && pieces[0].slot == -1;
+                }
+            };
+
+            struct Node {
+                NodeKind kind = command;
+                size_t line = 0;
+                std::vector<Word> words;
+                int slot = -1;
+
+                // command: resolved once, a function call if function is set
+                bool literal = true;
+                bool validated = false;
+                Command *target = nullptr;
+                Node *function = nullptr;
+                std::vector<std::string_view> argv;
+                std::vector<std::string> expanded;
+                std::vector<std::string_view> parameters;
+                // What a command that consumes its parameters is given instead of parameters
+                std::vector<std::string_view> scratch;
+
+                std::unique_ptr<Node> condition;
+                bool negate = false;
+                bool hasElse = false;
+                std::vector<Node> body;
+                std::vector<Node> elseBody;
+            };
+
+            static constexpr int MAX_CALL_DEPTH = 1000;
+
+            Mysh *mysh;
+            std::string name;
+            Tokenizer tokenizer;
+            std::vector<Node> body;
+            // Stable storage for every literal the nodes point into
+            std::deque<std::string> strings;
+            std::unordered_map<std::string, int> slots;
+            std::vector<std::string> values;
+            // Whether any word expands the slot, loops skip setting variables nothing reads
+            std::vector<bool> read;
+            std::unordered_map<std::string, Node *> functions;
+            int statusSlot;
+            int countSlot;
+            int callDepth = 0;
+
+            bool Error(size_t line, const char *message) const {
+                std::cerr << name << ":" << line << ": " << message << std::endl;
+                return false;
+            }
+
+            static bool IsName(std::string_view text) {
+                if (text.empty())
+                    return false;
+                for (char c : text) {
+                    if (!isalnum((unsigned char) c) && c != '_')
+                        return false;
+                }
+                return true;
+            }
+
+            int Slot(std::string_view variable) {
+                auto [it, added] = slots.emplace(std::string(variable), (int) values.size());
+                if (added) {
+                    values.emplace_back();
+                    read.push_back(false);
+                }
+                return it->second;
+            }
+
+            // Splits "out-{i}.txt" into literal and variable pieces; {} and {x y} stay literal
+            Word ParseWord(std::string_view token) {
+                Word word;
+                // Operators are recognised by address, they must stay the Tokenizer's own
+                if (Tokenizer::IsOperator(token)) {
+                    word.pieces.push_back({token, -1});
+                    return word;
+                }
+
+                std::string literal;
+                auto flush = [&]() {
+                    if (!literal.empty())
+                        word.pieces.push_back({strings.emplace_back(std::move(literal)), -1});
+                    literal.clear();
+                };
+
+                size_t from = 0;
+                while (from < token.size()) {
+                    size_t open = token.find('{', from);
+                    size_t close = open == std::string_view::npos ? open : token.find('}', open + 1);
+                    if (close == std::string_view::npos) {
+                        literal += token.substr(from);
+                        break;
+                    }
+
+                    std::string_view variable = token.substr(open + 1, close - open - 1);
+                    literal += token.substr(from, open - from);
+                    if (IsName(variable) || variable == "?" || variable == "#") {
+                        flush();
+                        int slot = Slot(variable);
+                        read[slot] = true;
+                        word.pieces.push_back({{}, slot});
+                    } else {
+                        literal += token.substr(open, close - open + 1);
+                    }
+                    from = close + 1;
+                }
+                flush();
+
+                if (word.pieces.empty())
+                    word.pieces.push_back({strings.emplace_back(), -1});
+                return word;
+            }
+
+            void ParseCommand(Node &node, const std::vector<std::string_view> &tokens, size_t first) {
+                node.kind = command;
+                for (size_t i = first; i < tokens.size(); i++) {
+                    node.words.push_back(ParseWord(tokens[i]));
+                    if (!node.words.back().IsLiteral())
+                        node.literal = false;
+                }
+                node.expanded.resize(node.words.size());
+                if (node.literal) {
+                    for (const Word &word : node.words)
+                        node.argv.push_back(word.pieces[0].text);
+                }
+            }
+
+            void ResolveCalls(std::vector<Node> &nodes) {
+                for (Node &node : nodes) {
+                    if (node.kind == command)
+                        ResolveCall(node);
+                    if (node.condition != nullptr)
+                        ResolveCall(*node.condition);
+                    ResolveCalls(node.body);
+                    ResolveCalls(node.elseBody);
+                }
+            }
+
+            void ResolveCall(Node &node) {
+                if (node.words.empty() || !node.words[0].IsLiteral())
+                    return;
+                std::string_view first = node.words[0].pieces[0].text;
+                auto function = functions.find(std::string(first));
+                if (function != functions.end())
+                    node.function = function->second;
+                else
+                    node.target = mysh->DetermineCommand(first);
+
+                if (node.target != nullptr && node.literal) {
+                    node.parameters.assign(node.argv.begin() + 1, node.argv.end());
+                    node.validated = node.target->InputParametersAreValid(node.parameters);
+                }
+            }
+
+            void SetArguments(const std::vector<std::string> &arguments) {
+                for (size_t i = 0; i < arguments.size(); i++)
+                    values[Slot(std::to_string(i + 1))] = arguments[i];
+                values[countSlot] = std::to_string(arguments.size());
+            }
+
+            ErrorCode RunBlock(std::vector<Node> &nodes) {
+                for (Node &node : nodes) {
+                    ErrorCode ec = RunNode(node);
+                    if (ec == request_exit)
+                        return ec;
+                }
+                return no_error;
+            }
+
+            ErrorCode RunNode(Node &node) {
+                switch (node.kind) {
+                    case command:
+                        return RunCommand(node);
+                    case assign: {
+                        std::string value;
+                        for (size_t i = 0; i < node.words.size(); i++) {
+                            if (i > 0)
+                                value += ' ';
+                            Expand(node.words[i], value);
+                        }
+                        values[node.slot] = std::move(value);
+                        return no_error;
+                    }
+                    case for_range: {
+                        std::string text;
+                        long first, last;
+                        Expand(node.words[0], text);
+                        bool valid = ParseNumber(text, first);
+                        text.clear();
+                        Expand(node.words[1], text);
+                        if (!valid || !ParseNumber(text, last)) {
+                            Error(node.line, "range bounds are not numbers");
+                            mysh->lastStatus = 1;
+                            return no_error;
+                        }
+
+                        char digits[24];
+                        bool used = read[node.slot];
+                        for (long i = first; i <= last; i++) {
+                            if (used) {
+                                auto result = std::to_chars(digits, digits + sizeof(digits), i);
+                                values[node.slot].assign(digits, result.ptr - digits);
+                            }
+                            if (RunBlock(node.body) == request_exit)
+                                return request_exit;
+                        }
+                        return no_error;
+                    }
+                    case for_list: {
+                        std::vector<std::string> items(node.words.size());
+                        for (size_t i = 0; i < node.words.size(); i++)
+                            Expand(node.words[i], items[i]);
+                        for (std::string &item : items) {
+                            if (read[node.slot])
+                                values[node.slot] = item;
+                            if (RunBlock(node.body) == request_exit)
+                                return request_exit;
+                        }
+                        return no_error;
+                    }
+                    case if_status: {
+                        ErrorCode ec = RunCommand(*node.condition);
+                        if (ec == request_exit)
+                            return ec;
+                        bool succeeded = (mysh->lastStatus == 0) != node.negate;
+                        return RunBlock(succeeded ? node.body : node.elseBody);
+                    }
+                    case function_definition:
+                        return no_error;
+                }
+                return no_error;
+            }
+
+            void Expand(const Word &word, std::string &out) {
+                for (const Piece &piece : word.pieces) {
+                    if (piece.slot == -1)
+                        out += piece.text;
+                    else if (piece.slot == statusSlot)
+                        out += std::to_string(mysh->lastStatus);
+                    else
+                        out += values[piece.slot];
+                }
+            }
+
+            ErrorCode RunCommand(Node &node) {
+                if (!node.literal) {
+                    node.argv.clear();
+                    for (size_t i = 0; i < node.words.size(); i++) {
+                        const Word &word = node.words[i];
+                        if (word.IsLiteral()) {
+                            node.argv.push_back(word.pieces[0].text);
+                            continue;
+                        }
+                        node.expanded[i].clear();
+                        Expand(word, node.expanded[i]);
+                        node.argv.push_back(node.expanded[i]);
+                    }
+                }
+
+                if (node.function != nullptr)
+                    return CallFunction(node);
+
+                Command *target = node.target;
+                if (target == nullptr)
+                    target = mysh->DetermineCommand(node.argv[0]);
+                if (target == nullptr) {
+                    mysh->lastStatus = command_does_not_exist;
+                    ErrorCodeHandler::HandleErrorCode(command_does_not_exist);
+                    return no_error;
+                }
+
+                ErrorCode ec;
+                if (node.validated && !target->consumesParameters) {
+                    ec = mysh->ExecuteValidated(target, node.parameters);
+                } else if (node.validated) {
+                    node.scratch.assign(node.parameters.begin(), node.parameters.end());
+                    ec = mysh->ExecuteValidated(target, node.scratch);
+                } else {
+                    node.parameters.assign(node.argv.begin() + 1, node.argv.end());
+                    ec = mysh->ExecuteCommand(target, node.parameters);
+                }
+                if (ec != no_error)
+                    ErrorCodeHandler::HandleErrorCode(ec);
+                return ec;
+            }
+
+            ErrorCode CallFunction(Node &node) {
+                if (callDepth >= MAX_CALL_DEPTH) {
+                    Error(node.line, "functions nested too deep");
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                // Arguments are copied out first, a recursive call reuses this node's buffers
+                std::vector<std::string> arguments(node.argv.begin() + 1, node.argv.end());
+                long previous = 0;
+                ParseNumber(values[countSlot], previous);
+                size_t count = std::max(arguments.size(), (size_t) std::max(previous, 0L));
+
+                // The caller's {1}.. and {#} come back once the function returns
+                std::vector<std::string> saved(count + 1);
+                for (size_t i = 0; i < count; i++) {
+                    std::string &argument = values[Slot(std::to_string(i + 1))];
+                    saved[i] = std::move(argument);
+                    argument = i < arguments.size() ? std::move(arguments[i]) : std::string();
+                }
+                saved[count] = std::move(values[countSlot]);
+                values[countSlot] = std::to_string(arguments.size());
+
+                callDepth++;
+                ErrorCode ec = RunBlock(node.function->body);
+                callDepth--;
+
+                for (size_t i = 0; i < count; i++)
+                    values[Slot(std::to_string(i + 1))] = std::move(saved[i]);
+                values[countSlot] = std::move(saved[count]);
+                return ec;
+            }
+        };
+    };
+
+    /**
+     * Current directory, the pushd stack and a frecency database of visited
+     * directories. Every successful move bumps the directory's rank; its score
+     * is that rank weighted by how recently it was visited, as in z/autojump.
+     * The database is one "rank<TAB>last visit<TAB>path" line per directory,
+     * loaded on first use and rewritten on exit by interactive sessions.
+     */
+    class DirectoryHandler {
+        class WhereAmI : public Command {
+        public:
+            explicit WhereAmI(Mysh *mysh, DirectoryHandler *directoryHandler) {
+                this->keyword = "whereami";
+                this->validParameters = {};
+                this->allowCustomParameters = false;
+                this->mysh = mysh;
+                this->directoryHandler = directoryHandler;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                directoryHandler->PrintCurrentDirectory();
+                return no_error;
+            }
+
+        private:
+            DirectoryHandler *directoryHandler;
+        };
+
+        class MoveToDirectory : public Command {
+        public:
+            explicit MoveToDirectory(Mysh *mysh, DirectoryHandler *directoryHandler) {
+                this->keyword = "movetodir";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+                this->mysh = mysh;
+                this->directoryHandler = directoryHandler;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.empty())
+                    return incorrect_parameters;
+
+                if (inputParameters[0] == "-j") {
+                    if (inputParameters.size() < 2)
+                        return incorrect_parameters;
+                    std::vector<std::string_view> fragments(inputParameters.begin() + 1, inputParameters.end());
+                    return directoryHandler->JumpToDirectory(fragments);
+                }
+
+                if (inputParameters.size() != 1)
+                    return incorrect_parameters;
+
+                return directoryHandler->ChangeCurrentDirectory(std::string(inputParameters[0]));
+            }
+
+        private:
+            DirectoryHandler *directoryHandler;
+        };
+
+        /**
+         * pushd dir moves and remembers where it came from, pushd alone swaps
+         * the top two, popd returns, dirs lists the stack
+         */
+        class DirectoryStack : public Command {
+        public:
+            explicit DirectoryStack(Mysh *mysh, DirectoryHandler *directoryHandler, const char *keyword) {
+                this->keyword = keyword;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+                this->mysh = mysh;
+                this->directoryHandler = directoryHandler;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (keyword == "dirs") {
+                    if (!inputParameters.empty())
+                        return incorrect_parameters;
+                    directoryHandler->PrintDirectoryStack();
+                    return no_error;
+                }
+
+                if (inputParameters.size() > (keyword == "pushd" ? 1u : 0u))
+                    return incorrect_parameters;
+
+                ErrorCode ec = keyword == "popd"
+                               ? directoryHandler->PopDirectory()
+                               : directoryHandler->PushDirectory(inputParameters.empty()
+                                                                 ? std::string() : std::string(inputParameters[0]));
+                if (ec == no_error && mysh->lastStatus == 0)
+                    directoryHandler->PrintDirectoryStack();
+                return ec;
+            }
+
+        private:
+            DirectoryHandler *directoryHandler;
+        };
+
+    public:
+        explicit DirectoryHandler(Mysh *mysh) {
+            this->mysh = mysh;
+            RefreshCurrentDirectory();
+
+            // Only interactive sessions feed the database, scripts would skew it
+            saveDatabase = mysh->input->IsInteractive();
+
+            mysh->commands.Register<WhereAmI>(mysh, this);
+            mysh->commands.Register<MoveToDirectory>(mysh, this);
+            mysh->commands.Register<DirectoryStack>(mysh, this, "pushd");
+            mysh->commands.Register<DirectoryStack>(mysh, this, "popd");
+            mysh->commands.Register<DirectoryStack>(mysh, this, "dirs");
+        }
+
+        ~DirectoryHandler() {
+            if (saveDatabase && databaseDirty)
+                SaveDatabase();
+        }
+
+        const std::string &GetCurrentDirectory() const {
+            return currentDirectory;
+        }
+
+        // Rebuilt only when the directory changes
+        const std::string &GetPrompt() const {
+            return prompt;
+        }
+
+    private:
+        struct Visited {
+            std::string path;
+            double rank;
+            time_t lastVisit;
+        };
+
+        // Past this total rank every entry is aged, and forgotten below 1
+        static constexpr double MAX_TOTAL_RANK = 9000;
+
+        Mysh *mysh;
+        std::string currentDirectory;
+        std::string prompt;
+        std::vector<std::string> directoryStack;
+
+        bool databaseLoaded = false;
+        bool databaseDirty = false;
+        bool saveDatabase = false;
+        std::vector<Visited> visited;
+        std::unordered_map<std::string, size_t> visitedByPath;
+        // Lowercased last path component -> entries, for exact name jumps
+        std::unordered_map<std::string, std::vector<size_t>> visitedByName;
+
+        void PrintCurrentDirectory() const {
+            std::cout << currentDirectory << std::endl;
+        }
+
+        void RefreshCurrentDirectory() {
+            // glibc sizes the buffer itself, so long paths are fine
+            char *path = getcwd(nullptr, 0);
+            if (path == nullptr) {
+                perror("Error getting current directory");
+                return;
+            }
+            currentDirectory = path;
+            free(path);
+
+            prompt = currentDirectory;
+            prompt += "# ";
+        }
+
+        ErrorCode ChangeCurrentDirectory(const std::string &inputPath) {
+            if (chdir(inputPath.c_str()) != 0)
+                return dir_does_not_exist;
+
+            RefreshCurrentDirectory();
+            RecordVisit(currentDirectory);
+            return no_error;
+        }
+
+        ErrorCode PushDirectory(const std::string &inputPath) {
+            std::string previous = currentDirectory;
+            if (inputPath.empty()) {
+                if (directoryStack.empty()) {
+                    std::cerr << "pushd: no other directory" << std::endl;
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+                std::string top = directoryStack.back();
+                ErrorCode ec = ChangeCurrentDirectory(top);
+                if (ec == no_error)
+                    directoryStack.back() = previous;
+                return ec;
+            }
+
+            ErrorCode ec = ChangeCurrentDirectory(inputPath);
+            if (ec == no_error)
+                directoryStack.push_back(previous);
+            return ec;
+        }
+
+        ErrorCode PopDirectory() {
+            if (directoryStack.empty()) {
+                std::cerr << "popd: directory stack empty" << std::endl;
+                mysh->lastStatus = 1;
+                return no_error;
+            }
+
+            ErrorCode ec = ChangeCurrentDirectory(directoryStack.back());
+            if (ec == no_error)
+                directoryStack.pop_back();
+            return ec;
+        }
+
+        void PrintDirectoryStack() const {
+            std::string out = currentDirectory;
+            for (auto it = directoryStack.rbegin(); it != directoryStack.rend(); ++it) {
+                out += ' ';
+                out += *it;
+            }
+            std::cout << out << std::endl;
+        }
+
+        /**
+         * Moves to the best scoring directory that contains every fragment in
+         * order, ignoring case. A last fragment naming the directory itself
+         * wins over one found further up the path.
+         */
+        ErrorCode JumpToDirectory(const std::vector<std::string_view> &fragments) {
+            LoadDatabase();
+
+            std::vector<std::string> lowered;
+            for (auto fragment : fragments)
+                lowered.push_back(Lowercase(fragment));
+
+            time_t now = time(nullptr);
+            const Visited *best = nullptr;
+            double bestScore = 0;
+            auto consider = [&](const Visited &entry, double weight) {
+                double score = Frecency(entry, now) * weight;
+                if (entry.path != currentDirectory && score > bestScore && MatchesInOrder(entry.path, lowered)) {
+                    best = &entry;
+                    bestScore = score;
+                }
+            };
+
+            // An exact name hit is a hash lookup and settles the jump; only without
+            // one does a substring match scan every entry
+            auto named = visitedByName.find(lowered.back());
+            if (named != visitedByName.end()) {
+                for (size_t index : named->second)
+                    consider(visited[index], 1.0);
+            }
+            if (best == nullptr) {
+                for (const Visited &entry : visited)
+                    consider(entry, Lowercase(Basename(entry.path)).find(lowered.back()) != std::string::npos ? 2.0 : 1.0);
+            }
+
+            if (best == nullptr) {
+                std::cerr << "movetodir: no match for";
+                for (auto fragment : fragments)
+                    std::cerr << ' ' << fragment;
+                std::cerr << std::endl;
+                mysh->lastStatus = 1;
+                return no_error;
+            }
+
+            std::string target = best->path;
+            std::cout << target << std::endl;
+            ErrorCode ec = ChangeCurrentDirectory(target);
+            if (ec != no_error)
+                Forget(target);
+            return ec;
+        }
+
+        static double Frecency(const Visited &entry, time_t now) {
+            double age = difftime(now, entry.lastVisit);
+            if (age < 3600)
+                return entry.rank * 4;
+            if (age < 86400)
+                return entry.rank * 2;
+            if (age < 604800)
+                return entry.rank / 2;
+            return entry.rank / 4;
+        }
+
+        static bool MatchesInOrder(const std::string &path, const std::vector<std::string> &fragments) {
+            std::string lowered = Lowercase(path);
+            size_t from = 0;
+            for (const auto &fragment : fragments) {
+                size_t at = lowered.find(fragment, from);
+                if (at == std::string::npos)
+                    return false;
+                from = at + fragment.size();
+            }
+            return true;
+        }
+
+        static std::string Lowercase(std::string_view text) {
+            std::string lowered(text);
+            for (char &c : lowered)
+                c = (char) tolower((unsigned char) c);
+            return lowered;
+        }
+
+        static std::string_view Basename(std::string_view path) {
+            size_t slash = path.find_last_of('/');
+            return slash == std::string_view::npos || path.size() == 1 ? path : path.substr(slash + 1);
+        }
+
+        void RecordVisit(const std::string &path) {
+            LoadDatabase();
+            databaseDirty = true;
+
+            auto it = visitedByPath.find(path);
+            if (it != visitedByPath.end()) {
+                visited[it->second].rank += 1;
+                visited[it->second].lastVisit = time(nullptr);
+            } else {
+                AddVisited({path, 1, time(nullptr)});
+            }
+
+            double total = 0;
+            for (const Visited &entry : visited)
+                total += entry.rank;
+            if (total > MAX_TOTAL_RANK) {
+                std::vector<Visited> aged;
+                for (Visited &entry : visited) {
+                    entry.rank *= 0.99;
+                    if (entry.rank >= 1)
+                        aged.push_back(std::move(entry));
+                }
+                RebuildIndex(std::move(aged));
+            }
+        }
+
+        void Forget(const std::string &path) {
+            std::vector<Visited> kept;
+            for (Visited &entry : visited) {
+                if (entry.path != path)
+                    kept.push_back(std::move(entry));
+            }
+            RebuildIndex(std::move(kept));
+            databaseDirty = true;
+        }
+
+        void AddVisited(Visited entry) {
+            size_t index = visited.size();
+            visitedByPath[entry.path] = index;
+            visitedByName[Lowercase(Basename(entry.path))].push_back(index);
+            visited.push_back(std::move(entry));
+        }
+
+        void RebuildIndex(std::vector<Visited> entries) {
+            visited.clear();
+            visitedByPath.clear();
+            visitedByName.clear();
+            for (Visited &entry : entries)
+                AddVisited(std::move(entry));
+        }
+
+        static std::string DatabasePath() {
+            const char *file = getenv("MYSH_DIRDB");
+            if (file != nullptr)
+                return file;
+            const char *home = getenv("HOME");
+            return home != nullptr ? std::string(home) + "/.mysh_dirs" : std::string();
+        }
+
+        void LoadDatabase() {
+            if (databaseLoaded)
+                return;
+            databaseLoaded = true;
+
+            std::string path = DatabasePath();
+            LineReader *reader = path.empty() ? nullptr : LineReader::FromFile(path);
+            if (reader == nullptr)
+                return;
+
+            std::string_view line;
+            while (reader->NextLine(line)) {
+                size_t firstTab = line.find('\t');
+                size_t secondTab = line.find('\t', firstTab + 1);
+                if (secondTab == std::string_view::npos)
+                    continue;
+
+                double rank = 0;
+                long lastVisit;
+                std::string_view rankText = line.substr(0, firstTab);
+                auto parsed = std::from_chars(rankText.data(), rankText.data() + rankText.size(), rank);
+                if (parsed.ec != std::errc() || rank <= 0 ||
+                    !ParseNumber(line.substr(firstTab + 1, secondTab - firstTab - 1), lastVisit))
+                    continue;
+
+                std::string entryPath(line.substr(secondTab + 1));
+                if (visitedByPath.count(entryPath) == 0)
+                    AddVisited({entryPath, rank, (time_t) lastVisit});
+            }
+            delete reader;
+        }
+
+        // Written to a temporary file and renamed, so a crash or another shell saving
+        // at the same time never leaves half a database
+        void SaveDatabase() const {
+            std::string path = DatabasePath();
+            if (path.empty())
+                return;
+
+            std::string out;
+            char prefix[64];
+            for (const Visited &entry : visited) {
+                snprintf(prefix, sizeof(prefix), "%.3f\t%ld\t", entry.rank, (long) entry.lastVisit);
+                out += prefix;
+                out += entry.path;
+                out += '\n';
+            }
+
+            if (!ReplaceFile(path, out))
+                perror(path.c_str());
+        }
+    };
+
+    class ProcessHandler {
+        friend struct ::MyshBench;
+
+        enum JobState {
+            job_running,
+            job_done,
+            job_killed,
+        };
+
+        // One process of a job, a job has one per pipeline stage
+        struct Process {
+            pid_t pid;
+            // Refers to this exact process even after its pid is reused, -1 without pidfd support
+            int pidfd;
+            bool running;
+        };
+
+        struct Job {
+            // The first stage, which also leads the process group
+            pid_t pid;
+            pid_t pgid;
+            std::string commandLine;
+            std::vector<Process> processes;
+            size_t runningProcesses;
+            JobState state;
+            // Raw waitpid status of the last stage, valid once the job is no longer running
+            int waitStatus;
+            std::chrono::steady_clock::time_point startTime;
+            std::chrono::steady_clock::time_point endTime;
+            // Who started it: a --serve client's id, 0 for the shell's own input
+            uint64_t owner;
+
+            Process *FindProcess(pid_t processPid) {
+                for (Process &process : processes) {
+                    if (process.pid == processPid)
+                        return &process;
+                }
+                return nullptr;
+            }
+        };
+
+        /**
+         * Background jobs in a dense vector for iteration, with a pid -> index
+         * hash map that finds a job by any of its processes. Removing swaps the
+         * last job into the hole, so insert, lookup and remove stay O(1)
+         * however many jobs are tracked.
+         */
+        class JobTable {
+        public:
+            Job *Add(pid_t pid, pid_t pgid, std::string commandLine) {
+                // The kernel may have reused the pid of a job we still remember
+                Remove(pid);
+
+                jobs.emplace_back();
+                Job &job = jobs.back();
+                job.pid = pid;
+                job.pgid = pgid;
+                job.commandLine = std::move(commandLine);
+                job.runningProcesses = 0;
+                job.state = job_running;
+                job.waitStatus = 0;
+                job.startTime = std::chrono::steady_clock::now();
+                running++;
+
+                return AddProcess(&job, pid);
+            }
+
+            // Another pipeline stage of job, returns where job is now
+            Job *AddProcess(Job *job, pid_t pid) {
+                // Removing a stale job may move this one
+                pid_t leader = job->pid;
+                if (pid != leader && Remove(pid))
+                    job = Find(leader);
+
+                index[pid] = job - jobs.data();
+                job->processes.push_back({pid, -1, true});
+                job->runningProcesses++;
+                return job;
+            }
+
+            Job *Find(pid_t pid) {
+                auto it = index.find(pid);
+                return it != index.end() ? &jobs[it->second] : nullptr;
+            }
+
+            bool Remove(pid_t pid) {
+                auto it = index.find(pid);
+                if (it == index.end())
+                    return false;
+
+                size_t hole = it->second;
+                for (const Process &process : jobs[hole].processes)
+                    index.erase(process.pid);
+
+                if (jobs[hole].state == job_running)
+                    running--;
+
+                if (hole != jobs.size() - 1) {
+                    jobs[hole] = std::move(jobs.back());
+                    for (const Process &process : jobs[hole].processes)
+                        index[process.pid] = hole;
+                }
+                jobs.pop_back();
+                return true;
+            }
+
+            // The job finishes with its last process, its status is the last stage's
+            void MarkProcessFinished(Job *job, pid_t pid, int waitStatus) {
+                Process *process = job->FindProcess(pid);
+                if (process == nullptr || !process->running)
+                    return;
+
+                process->running = false;
+                job->runningProcesses--;
+                if (process == &job->processes.back())
+                    job->waitStatus = waitStatus;
+
+                if (job->runningProcesses > 0 || job->state != job_running)
+                    return;
+
+                running--;
+                job->state = WIFSIGNALED(job->waitStatus) ? job_killed : job_done;
+                job->endTime = std::chrono::steady_clock::now();
+            }
+
+            // Drops every job that is no longer running
+            void RemoveFinished() {
+                for (size_t i = 0; i < jobs.size();) {
+                    if (jobs[i].state != job_running)
+                        Remove(jobs[i].pid);
+                    else
+                        i++;
+                }
+            }
+
+            void Clear() {
+                jobs.clear();
+                index.clear();
+                running = 0;
+            }
+
+            size_t Size() const {
+                return jobs.size();
+            }
+
+            size_t Running() const {
+                return running;
+            }
+
+            std::vector<Job>::iterator begin() {
+                return jobs.begin();
+            }
+
+            std::vector<Job>::iterator end() {
+                return jobs.end();
+            }
+
+        private:
+            std::vector<Job> jobs;
+            std::unordered_map<pid_t, size_t> index;
+            size_t running = 0;
+        };
+
+        /**
+         * Per-child resource accounting from wait4(). Launch records when and
+         * how fast each child started, the reaping side adds its rusage. Wall
+         * time and launch latency go into per-command histograms for stats,
+         * next to totals of CPU, page faults and context switches;
+         * while a time report is open, its children are also summed for it.
+         */
+        class Accounting {
+        public:
+            struct Report {
+                size_t processes = 0;
+                double userSeconds = 0;
+                double systemSeconds = 0;
+                long maxRssKb = 0;
+                long minorFaults = 0;
+                long majorFaults = 0;
+                long voluntarySwitches = 0;
+                long involuntarySwitches = 0;
+                double launchSeconds = 0;
+            };
+
+            void Started(pid_t pid, const char *program, std::chrono::steady_clock::time_point start,
+                         std::chrono::steady_clock::duration launchLatency) {
+                const char *slash = strrchr(program, '/');
+                launches[pid] = {slash != nullptr ? slash + 1 : program, start, launchLatency, report != nullptr};
+            }
+
+            void Finished(pid_t pid, const struct rusage &usage) {
+                auto it = launches.find(pid);
+                if (it == launches.end())
+                    return;
+
+                const Launch &launch = it->second;
+                auto wall = std::chrono::steady_clock::now() - launch.start;
+
+                CommandStats &command = commands[launch.name];
+                command.wallMicros.Record(std::chrono::duration_cast<std::chrono::microseconds>(wall).count());
+                command.launchMicros.Record(
+                        std::chrono::duration_cast<std::chrono::microseconds>(launch.launchLatency).count());
+                command.cpuSeconds += Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+                command.maxRssKb = std::max(command.maxRssKb, usage.ru_maxrss);
+                command.minorFaults += usage.ru_minflt;
+                command.majorFaults += usage.ru_majflt;
+                command.voluntarySwitches += usage.ru_nvcsw;
+                command.involuntarySwitches += usage.ru_nivcsw;
+
+                if (launch.timed && report != nullptr) {
+                    report->processes++;
+                    report->userSeconds += Seconds(usage.ru_utime);
+                    report->systemSeconds += Seconds(usage.ru_stime);
+                    report->maxRssKb = std::max(report->maxRssKb, usage.ru_maxrss);
+                    report->minorFaults += usage.ru_minflt;
+                    report->majorFaults += usage.ru_majflt;
+                    report->voluntarySwitches += usage.ru_nvcsw;
+                    report->involuntarySwitches += usage.ru_nivcsw;
+                    report->launchSeconds += std::chrono::duration<double>(launch.launchLatency).count();
+                }
+
+                launches.erase(it);
+            }
+
+            // Children started until EndReport are summed into report
+            void BeginReport(Report *timedReport) {
+                report = timedReport;
+            }
+
+            void EndReport() {
+                report = nullptr;
+            }
+
+            void Print() {
+                if (commands.empty()) {
+                    std::cout << "no commands recorded" << std::endl;
+                    return;
+                }
+
+                std::string out;
+                char row[256];
+                snprintf(row, sizeof(row), "%-16s %8s  %-26s %-26s %10s %9s  %-21s %s\n", "COMMAND", "COUNT",
+                         "WALL p50/p95/p99 (ms)", "LAUNCH p50/p95/p99 (us)", "CPU (s)", "MAXRSS", "FAULTS major/minor",
+                         "SWITCHES vol/invol");
+                out += row;
+
+                for (const auto &[name, command] : commands) {
+                    char wall[32], launch[32], faults[48], switches[48];
+                    snprintf(wall, sizeof(wall), "%.2f/%.2f/%.2f", command.wallMicros.Percentile(50) / 1000.0,
+                             command.wallMicros.Percentile(95) / 1000.0, command.wallMicros.Percentile(99) / 1000.0);
+                    snprintf(launch, sizeof(launch), "%lu/%lu/%lu", (unsigned long) command.launchMicros.Percentile(50),
+                             (unsigned long) command.launchMicros.Percentile(95),
+                             (unsigned long) command.launchMicros.Percentile(99));
+                    snprintf(faults, sizeof(faults), "%ld/%ld", command.majorFaults, command.minorFaults);
+                    snprintf(switches, sizeof(switches), "%ld/%ld", command.voluntarySwitches,
+                             command.involuntarySwitches);
+                    snprintf(row, sizeof(row), "%-16s %8lu  %-26s %-26s %10.3f %8ldK  %-21s %s\n", name.c_str(),
+                             (unsigned long) command.wallMicros.Count(), wall, launch, command.cpuSeconds,
+                             command.maxRssKb, faults, switches);
+                    out += row;
+                }
+                std::cout << out << std::flush;
+            }
+
+            void Clear() {
+                commands.clear();
+            }
+
+        private:
+            struct Launch {
+                std::string name;
+                std::chrono::steady_clock::time_point start;
+                std::chrono::steady_clock::duration launchLatency;
+                bool timed;
+            };
+
+            struct CommandStats {
+                Histogram wallMicros;
+                Histogram launchMicros;
+                double cpuSeconds = 0;
+                long maxRssKb = 0;
+                long minorFaults = 0;
+                long majorFaults = 0;
+                long voluntarySwitches = 0;
+                long involuntarySwitches = 0;
+            };
+
+            std::unordered_map<pid_t, Launch> launches;
+            std::unordered_map<std::string, CommandStats> commands;
+            Report *report = nullptr;
+
+            static double Seconds(const struct timeval &tv) {
+                return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+            }
+        };
+
+        /**
+         * On-disk results of earlier runs, one file per key named by its
+         * 128-bit hash. The file repeats the key, so a hash collision is a
+         * miss, followed by the exit status, stdout and stderr. Hits touch the
+         * file's mtime, and eviction removes the least recently used files
+         * once the directory outgrows its limit.
+         */
+        class ResultCache {
+        public:
+            struct Result {
+                int status = 0;
+                std::string out;
+                std::string err;
+                double runSeconds = 0;
+            };
+
+            ResultCache() {
+                long megabytes;
+                const char *size = getenv("MYSH_CACHE_SIZE");
+                if (size == nullptr || !ParseNumber(size, megabytes) || megabytes < 1)
+                    megabytes = DEFAULT_LIMIT_MB;
+                limitBytes = megabytes << 20;
+            }
+
+            // A result bigger than this is run but never stored
+            size_t MaxEntryBytes() const {
+                return limitBytes / 4;
+            }
+
+            bool Lookup(const std::string &key, Result &result) {
+                std::string path = EntryPath(key);
+                if (path.empty())
+                    return false;
+
+                int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd == -1)
+                    return false;
+
+                std::string contents;
+                struct stat st{};
+                bool read = fstat(fd, &st) == 0 && ReadAll(fd, contents, st.st_size);
+                // Marks it recently used for eviction
+                if (read)
+                    futimens(fd, nullptr);
+                close(fd);
+
+                size_t header = contents.find('\n');
+                unsigned long keySize, outSize, errSize, runMicros;
+                int status;
+                if (!read || header == std::string::npos ||
+                    sscanf(contents.c_str(), "mysh-cache-1 %d %lu %lu %lu %lu", &status, &keySize, &outSize,
+                           &errSize, &runMicros) != 5 ||
+                    contents.size() != header + 1 + keySize + outSize + errSize ||
+                    contents.compare(header + 1, keySize, key) != 0)
+                    return false;
+
+                result.status = status;
+                result.out = contents.substr(header + 1 + keySize, outSize);
+                result.err = contents.substr(header + 1 + keySize + outSize, errSize);
+                result.runSeconds = (double) runMicros / 1e6;
+                return true;
+            }
+
+            void Store(const std::string &key, const Result &result) {
+                std::string path = EntryPath(key);
+                if (path.empty())
+                    return;
+
+                char header[128];
+                snprintf(header, sizeof(header), "mysh-cache-1 %d %zu %zu %zu %lu\n", result.status, key.size(),
+                         result.out.size(), result.err.size(), (unsigned long) (result.runSeconds * 1e6));
+                std::string contents = header + key + result.out + result.err;
+
+                // Readers see the old entry or the new one, never half of it
+                if (!ReplaceFile(path, contents))
+                    return;
+
+                Evict();
+            }
+
+            void RecordHit(double savedSeconds) {
+                UpdateCounters(1, 0, savedSeconds);
+            }
+
+            void RecordMiss() {
+                UpdateCounters(0, 1, 0);
+            }
+
+            void PrintStats() {
+                unsigned long hits = 0, misses = 0;
+                double saved = 0;
+                ReadCounters(hits, misses, saved);
+
+                size_t entries = 0, bytes = 0;
+                ForEachEntry([&](const std::string &, const struct stat &st) {
+                    entries++;
+                    bytes += st.st_size;
+                });
+
+                unsigned long lookups = hits + misses;
+                printf("entries %zu, %.1f of %.0f MiB\n", entries, (double) bytes / (1 << 20),
+                       (double) limitBytes / (1 << 20));
+                printf("hits %lu, misses %lu, hit rate %.1f%%\n", hits, misses,
+                       lookups > 0 ? 100.0 * (double) hits / (double) lookups : 0.0);
+                printf("time saved %.3fs\n", saved);
+            }
+
+            void Clear() {
+                ForEachEntry([](const std::string &path, const struct stat &) { unlink(path.c_str()); });
+                std::string directory = Directory();
+                if (!directory.empty())
+                    unlink((directory + "/stats").c_str());
+            }
+
+        private:
+            static constexpr long DEFAULT_LIMIT_MB = 64;
+
+            long limitBytes;
+            std::string directory;
+
+            // $MYSH_CACHE_DIR, else $XDG_CACHE_HOME/mysh or ~/.cache/mysh, created on first use
+            const std::string &Directory() {
+                if (!directory.empty())
+                    return directory;
+
+                const char *configured = getenv("MYSH_CACHE_DIR");
+                const char *xdg = getenv("XDG_CACHE_HOME");
+                const char *home = getenv("HOME");
+                std::string parent;
+                if (configured != nullptr && *configured != '\0') {
+                    directory = configured;
+                } else if (xdg != nullptr && *xdg != '\0') {
+                    parent = xdg;
+                } else if (home != nullptr) {
+                    parent = std::string(home) + "/.cache";
+                } else {
+                    return directory;
+                }
+
+                if (!parent.empty()) {
+                    mkdir(parent.c_str(), 0700);
+                    directory = parent + "/mysh";
+                }
+                if (mkdir(directory.c_str(), 0700) == -1 && errno != EEXIST) {
+                    perror(directory.c_str());
+                    directory.clear();
+                }
+                return directory;
+            }
+
+            std::string EntryPath(const std::string &key) {
+                const std::string &base = Directory();
+                if (base.empty())
+                    return base;
+
+                char name[40];
+                snprintf(name, sizeof(name), "%016lx%016lx", (unsigned long) Fnv1a(key, 14695981039346656037ull),
+                         (unsigned long) Fnv1a(key, 0x9e3779b97f4a7c15ull));
+                return base + "/" + name;
+            }
+
+            static uint64_t Fnv1a(const std::string &text, uint64_t hash) {
+                for (char c : text) {
+                    hash ^= (unsigned char) c;
+                    hash *= 1099511628211ull;
+                }
+                return hash;
+            }
+
+            static bool ReadAll(int fd, std::string &contents, size_t size) {
+                contents.resize(size);
+                size_t done = 0;
+                while (done < size) {
+                    ssize_t n = read(fd, &contents[done], size - done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        return false;
+                    done += n;
+                }
+                return true;
+            }
+
+            // Entries are the files named by 32 hex digits
+            template<typename F>
+            void ForEachEntry(F visit) {
+                const std::string &base = Directory();
+                DIR *dir = base.empty() ? nullptr : opendir(base.c_str());
+                if (dir == nullptr)
+                    return;
+
+                struct dirent *entry;
+                while ((entry = readdir(dir)) != nullptr) {
+                    if (strlen(entry->d_name) != 32 || strspn(entry->d_name, "0123456789abcdef") != 32)
+                        continue;
+                    std::string path = base + "/" + entry->d_name;
+                    struct stat st{};
+                    if (stat(path.c_str(), &st) == 0)
+                        visit(path, st);
+                }
+                closedir(dir);
+            }
+
+            // Oldest first until the cache is back under 90% of its limit
+            void Evict() {
+                std::vector<std::pair<struct timespec, std::pair<std::string, off_t>>> entries;
+                size_t bytes = 0;
+                ForEachEntry([&](const std::string &path, const struct stat &st) {
+                    entries.push_back({st.st_mtim, {path, st.st_size}});
+                    bytes += st.st_size;
+                });
+                if (bytes <= (size_t) limitBytes)
+                    return;
+
+                std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+                    return a.first.tv_sec != b.first.tv_sec ? a.first.tv_sec < b.first.tv_sec
+                                                            : a.first.tv_nsec < b.first.tv_nsec;
+                });
+                for (const auto &[mtime, file] : entries) {
+                    if (bytes <= (size_t) limitBytes / 10 * 9)
+                        break;
+                    if (unlink(file.first.c_str()) == 0)
+                        bytes -= file.second;
+                }
+            }
+
+            void ReadCounters(unsigned long &hits, unsigned long &misses, double &saved) {
+                const std::string &base = Directory();
+                FILE *file = base.empty() ? nullptr : fopen((base + "/stats").c_str(), "re");
+                if (file == nullptr)
+                    return;
+                if (fscanf(file, "%lu %lu %lf", &hits, &misses, &saved) != 3)
+                    hits = misses = 0, saved = 0;
+                fclose(file);
+            }
+
+            void UpdateCounters(unsigned long hits, unsigned long misses, double saved) {
+                unsigned long totalHits = 0, totalMisses = 0;
+                double totalSaved = 0;
+                ReadCounters(totalHits, totalMisses, totalSaved);
+
+                const std::string &base = Directory();
+                FILE *file = base.empty() ? nullptr : fopen((base + "/stats").c_str(), "we");
+                if (file == nullptr)
+                    return;
+                fprintf(file, "%lu %lu %.6f\n", totalHits + hits, totalMisses + misses, totalSaved + saved);
+                fclose(file);
+            }
+        };
+
+        class RunForeground : public Command {
+        public:
+            explicit RunForeground(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "run";
+                this->consumesParameters = true;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+
+                LaunchOptions options;
+                if (!ParseResourceOptions(inputParameters, options)) {
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                if (inputParameters.empty())
+                    return incorrect_parameters;
+
+                if (HasPipe(inputParameters))
+                    return processHandler->RunPipeline(inputParameters, false, options);
+
+                if (!ParseRedirections(inputParameters, options)) {
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                char **arguments = InputParametersToCharArguments(inputParameters);
+
+                ErrorCode ec = processHandler->ForkExecWait(arguments, options, &mysh->lastStatus);
+
+                FreeCharArguments(arguments);
+                CloseRedirections(options);
+
+                return ec;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * cached run ... replays the stored result of an identical earlier run
+         */
+        class Cached : public Command {
+        public:
+            explicit Cached(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "cached";
+                this->consumesParameters = true;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.size() < 2 || inputParameters[0] != "run")
+                    return incorrect_parameters;
+
+                inputParameters.erase(inputParameters.begin());
+                return processHandler->RunCached(inputParameters);
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        class Cache : public Command {
+        public:
+            explicit Cache(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "cache";
+                this->validParameters = {"stats", "clear"};
+                this->allowCustomParameters = false;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.size() != 1)
+                    return incorrect_parameters;
+
+                if (inputParameters[0] == "clear")
+                    processHandler->resultCache.Clear();
+                else
+                    processHandler->resultCache.PrintStats();
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        class RunBackground : public Command {
+        public:
+            explicit RunBackground(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "background";
+                this->consumesParameters = true;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                LaunchOptions options;
+                // A server has no terminal to write to, the owner reads the output with joblog
+                bool capture = mysh->serving;
+                std::string logPath;
+
+                size_t first = 0;
+                while (first < inputParameters.size()) {
+                    int consumed = ParseResourceOption(inputParameters, first, options);
+                    if (consumed < 0) {
+                        mysh->lastStatus = 1;
+                        return no_error;
+                    }
+                    if (consumed > 0) {
+                        first += consumed;
+                    } else if (inputParameters[first] == "--capture") {
+                        capture = true;
+                        first++;
+                    } else if (inputParameters[first] == "--log" && first + 1 < inputParameters.size()) {
+                        capture = true;
+                        logPath = inputParameters[first + 1];
+                        first += 2;
+                    } else {
+                        break;
+                    }
+                }
+                inputParameters.erase(inputParameters.begin(), inputParameters.begin() + first);
+
+                if (inputParameters.empty())
+                    return incorrect_parameters;
+
+                // Output goes into a pipe the event loop drains, set up ahead of the job's own redirects
+                int captureFds[2] = {-1, -1};
+                if (capture && !processHandler->OpenCapture(captureFds, options)) {
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                ErrorCode ec = no_error;
+                pid_t pid = -1;
+                if (HasPipe(inputParameters)) {
+                    ec = processHandler->RunPipeline(inputParameters, true, options, &pid);
+                } else {
+                    std::string commandLine = JoinParameters(inputParameters);
+
+                    if (ParseRedirections(inputParameters, options)) {
+                        char **arguments = InputParametersToCharArguments(inputParameters);
+                        ec = processHandler->ForkExecBackground(arguments, options, &pid);
+                        FreeCharArguments(arguments);
+
+                        if (pid > 0) {
+                            printf("child (pid:%ld)\n", (long) pid);
+                            processHandler->TrackJob({pid}, pid, commandLine);
+                        } else {
+                            mysh->lastStatus = 127;
+                        }
+                    } else {
+                        mysh->lastStatus = 1;
+                    }
+                    CloseRedirections(options);
+                }
+
+                if (capture)
+                    processHandler->AttachCapture(pid, captureFds, logPath);
+
+                return ec;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        class ExterminatePID : public Command {
+        public:
+            explicit ExterminatePID(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "exterminate";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                double grace = 2.0;
+                size_t first = 0;
+                if (inputParameters.size() == 3 && inputParameters[0] == "--grace") {
+                    if (!ParseDuration(inputParameters[1], grace))
+                        return incorrect_parameters;
+                    first = 2;
+                }
+                if (inputParameters.size() != first + 1)
+                    return incorrect_parameters;
+
+                // 0 and negative pids would signal process groups, or everything we may signal
+                long pid;
+                if (!ParseNumber(inputParameters[first], pid) || pid <= 0 || pid > INT_MAX)
+                    return incorrect_parameters;
+
+                processHandler->ReapBackgroundPIDs();
+                if (processHandler->IsReapedProcess(pid)) {
+                    std::cout << pid << " was already dead" << std::endl;
+                    return no_error;
+                }
+
+                // Stays in the job table until it is reported, so it leaves no zombie
+                return processHandler->KillPID(pid, grace);
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Extra Credit: Murder all background processes
+         */
+        class ExterminateAll : public Command {
+        public:
+            explicit ExterminateAll(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "exterminateall";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                double grace = 2.0;
+
+                if (!inputParameters.empty()) {
+                    if (inputParameters.size() != 2 || inputParameters[0] != "--grace" ||
+                        !ParseDuration(inputParameters[1], grace))
+                        return incorrect_parameters;
+                }
+
+                return processHandler->KillAllPIDs(grace);
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Extra Credit: Repeat command N times
+         */
+        class Repeat : public Command {
+        public:
+            explicit Repeat(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "repeat";
+                this->consumesParameters = true;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                ErrorCode errorCode = no_error;
+
+                // Default to one child per core
+                long maxInFlight = sysconf(_SC_NPROCESSORS_ONLN);
+                bool limited = false;
+                bool spread = false;
+                double rate = 0;
+                double durationSeconds = -1;
+                LaunchOptions options;
+
+                size_t first = 0;
+                while (first < inputParameters.size()) {
+                    int consumed = ParseResourceOption(inputParameters, first, options);
+                    if (consumed < 0) {
+                        mysh->lastStatus = 1;
+                        return no_error;
+                    }
+                    if (consumed > 0) {
+                        first += consumed;
+                    } else if (inputParameters[first] == "--spread") {
+                        spread = true;
+                        first++;
+                    } else if (inputParameters[first] == "-j") {
+                        if (first + 1 == inputParameters.size() ||
+                            !ParseNumber(inputParameters[first + 1], maxInFlight) || maxInFlight < 1)
+                            return incorrect_parameters;
+                        limited = true;
+                        first += 2;
+                    } else if (inputParameters[first] == "--rate") {
+                        if (first + 1 == inputParameters.size() || !ParseRate(inputParameters[first + 1], rate))
+                            return incorrect_parameters;
+                        first += 2;
+                    } else if (inputParameters[first] == "--duration") {
+                        if (first + 1 == inputParameters.size() ||
+                            !ParseDuration(inputParameters[first + 1], durationSeconds))
+                            return incorrect_parameters;
+                        first += 2;
+                    } else {
+                        break;
+                    }
+                }
+                if (maxInFlight < 1)
+                    maxInFlight = 1;
+                inputParameters.erase(inputParameters.begin(), inputParameters.begin() + first);
+
+                // Paced runs are open loop, -j only caps them when given
+                bool paced = rate > 0;
+                if ((durationSeconds >= 0 && !paced) || (paced && spread))
+                    return incorrect_parameters;
+                if (paced && !limited)
+                    maxInFlight = PACED_MAX_IN_FLIGHT;
+
+                // With --duration the count is optional, whichever limit comes first ends the run
+                long n = LONG_MAX;
+                bool bounded = paced && durationSeconds >= 0;
+                bool counted = inputParameters.size() >= 2 && ParseNumber(inputParameters[0], n);
+                if ((!counted && !bounded) || (counted && n < 0))
+                    return incorrect_parameters;
+
+                if (counted)
+                    inputParameters.erase(inputParameters.begin());
+                else
+                    n = LONG_MAX;
+
+                // Redirected files are opened once and shared by every copy
+                if (!ParseRedirections(inputParameters, options) || inputParameters.empty()) {
+                    CloseRedirections(options);
+                    mysh->lastStatus = 1;
+                    return inputParameters.empty() ? incorrect_parameters : no_error;
+                }
+
+                char **arguments = InputParametersToCharArguments(inputParameters);
+                if (paced)
+                    errorCode = processHandler->PacedRepeat(arguments, options, n, durationSeconds, rate, maxInFlight);
+                else
+                    errorCode = processHandler->RepeatCommand(arguments, options, n, maxInFlight, spread);
+                FreeCharArguments(arguments);
+                CloseRedirections(options);
+
+                return errorCode;
+            }
+
+        private:
+            // Keeps a stuck service from turning an open-loop run into a fork bomb
+            static constexpr long PACED_MAX_IN_FLIGHT = 4096;
+
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Run a command once per input item, substituted for {} or appended.
+         * Items come from "< file" lines or the words after ":::". Each job's
+         * output is buffered and printed whole when it finishes, -k keeps it
+         * in input order.
+         */
+        class Parallel : public Command {
+        public:
+            explicit Parallel(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "parallel";
+                this->consumesParameters = true;
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                long maxInFlight = sysconf(_SC_NPROCESSORS_ONLN);
+                bool keepOrder = false;
+                LaunchOptions options;
+
+                size_t first = 0;
+                while (first < inputParameters.size()) {
+                    if (inputParameters[first] == "-k") {
+                        keepOrder = true;
+                        first++;
+                    } else if (inputParameters[first] == "-j") {
+                        if (first + 1 == inputParameters.size() ||
+                            !ParseNumber(inputParameters[first + 1], maxInFlight) || maxInFlight < 1)
+                            return incorrect_parameters;
+                        first += 2;
+                    } else {
+                        int consumed = ParseResourceOption(inputParameters, first, options);
+                        if (consumed < 0) {
+                            mysh->lastStatus = 1;
+                            return no_error;
+                        }
+                        if (consumed == 0)
+                            break;
+                        first += consumed;
+                    }
+                }
+                if (maxInFlight < 1)
+                    maxInFlight = 1;
+                inputParameters.erase(inputParameters.begin(), inputParameters.begin() + first);
+
+                std::vector<std::string> items;
+                auto separator = std::find(inputParameters.begin(), inputParameters.end(), ":::");
+                if (separator != inputParameters.end()) {
+                    // Items run up to the first redirect, which still applies to the jobs
+                    auto last = std::find_if(separator + 1, inputParameters.end(), [](std::string_view token) {
+                        return Tokenizer::IsOperator(token);
+                    });
+                    items.assign(separator + 1, last);
+                    inputParameters.erase(separator, last);
+                } else if (!ReadItems(inputParameters, items)) {
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+
+                if (!ParseRedirections(inputParameters, options) || inputParameters.empty()) {
+                    CloseRedirections(options);
+                    mysh->lastStatus = 1;
+                    return inputParameters.empty() ? incorrect_parameters : no_error;
+                }
+
+                ErrorCode errorCode = processHandler->ParallelCommand(inputParameters, items, options,
+                                                                      maxInFlight, keepOrder);
+                CloseRedirections(options);
+                return errorCode;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+
+            // Takes "< file" out of the parameters and reads its non-empty lines
+            static bool ReadItems(std::vector<std::string_view> &inputParameters, std::vector<std::string> &items) {
+                auto input = std::find_if(inputParameters.begin(), inputParameters.end(), [](std::string_view token) {
+                    return Tokenizer::IsOperator(token, Tokenizer::INPUT);
+                });
+                if (input == inputParameters.end() || input + 1 == inputParameters.end()) {
+                    std::cerr << "parallel: no items, use < file or ::: item..." << std::endl;
+                    return false;
+                }
+
+                std::string path(*(input + 1));
+                LineReader *reader = LineReader::FromFile(path);
+                if (reader == nullptr) {
+                    perror(path.c_str());
+                    return false;
+                }
+
+                std::string_view line;
+                while (reader->NextLine(line)) {
+                    if (!line.empty())
+                        items.emplace_back(line);
+                }
+                delete reader;
+
+                inputParameters.erase(input, input + 2);
+                return true;
+            }
+        };
+
+        /**
+         * Select how children are started, so fork and posix_spawn can be
+         * benchmarked side by side
+         */
+        class SelectSpawnEngine : public Command {
+        public:
+            explicit SelectSpawnEngine(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "spawnengine";
+                this->validParameters = {"fork", "posix_spawn"};
+                this->allowCustomParameters = false;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (!inputParameters.empty())
+                    processHandler->spawnEngine = inputParameters[0] == "fork" ? fork_engine : posix_spawn_engine;
+
+                std::cout << (processHandler->spawnEngine == fork_engine ? "fork" : "posix_spawn") << std::endl;
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Run a command and report wall time plus the rusage of every child it
+         * started: CPU, max RSS, page faults, context switches, launch latency
+         */
+        class Time : public Command {
+        public:
+            explicit Time(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "time";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.empty())
+                    return incorrect_parameters;
+
+                Accounting::Report report;
+                auto start = std::chrono::steady_clock::now();
+
+                processHandler->accounting.BeginReport(&report);
+                ErrorCode ec = mysh->ExecuteCommand(inputParameters);
+                processHandler->accounting.EndReport();
+
+                double real = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                char out[512];
+                snprintf(out, sizeof(out),
+                         "real %.3fs  user %.3fs  sys %.3fs\n"
+                         "max rss %ldK  page faults %ld major / %ld minor  "
+                         "context switches %ld voluntary / %ld involuntary\n"
+                         "launch latency %.3fms avg over %zu processes\n",
+                         real, report.userSeconds, report.systemSeconds, report.maxRssKb, report.majorFaults,
+                         report.minorFaults, report.voluntarySwitches, report.involuntarySwitches,
+                         report.processes > 0 ? report.launchSeconds * 1000 / (double) report.processes : 0.0,
+                         report.processes);
+                std::cerr << out << std::flush;
+
+                return ec;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Wall time and launch latency percentiles per command name, with its
+         * CPU, max RSS, page faults and context switches, -c to reset
+         */
+        class Stats : public Command {
+        public:
+            explicit Stats(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "stats";
+                this->validParameters = {"-c"};
+                this->allowCustomParameters = false;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (!inputParameters.empty())
+                    processHandler->accounting.Clear();
+                else
+                    processHandler->accounting.Print();
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Print what a background --capture job wrote, -f to keep following it
+         * until the job closes its output
+         */
+        class JobLog : public Command {
+        public:
+            explicit JobLog(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "joblog";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                bool follow = false;
+                long pid = -1;
+                for (auto parameter : inputParameters) {
+                    if (parameter == "-f")
+                        follow = true;
+                    else if (pid != -1 || !ParseNumber(parameter, pid) || pid <= 0)
+                        return incorrect_parameters;
+                }
+                if (pid == -1)
+                    return incorrect_parameters;
+
+                if (!processHandler->PrintCapture((pid_t) pid, follow)) {
+                    std::cerr << "joblog: no captured output for " << pid << std::endl;
+                    mysh->lastStatus = 1;
+                }
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * List tracked background jobs. Finished ones are listed once, then dropped
+         */
+        class Jobs : public Command {
+        public:
+            explicit Jobs(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "jobs";
+                this->validParameters = {};
+                this->allowCustomParameters = false;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                processHandler->ReapBackgroundPIDs();
+                processHandler->ListJobs();
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Block until the given background jobs, or all of them, have exited,
+         * or just the first of them with --any, then summarize how they ended
+         */
+        class Wait : public Command {
+        public:
+            explicit Wait(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "wait";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                bool any = false;
+                double timeoutSeconds = -1;
+                std::vector<pid_t> pids;
+
+                for (size_t i = 0; i < inputParameters.size(); i++) {
+                    long pid;
+                    if (inputParameters[i] == "--any") {
+                        any = true;
+                    } else if (inputParameters[i] == "--timeout") {
+                        if (i + 1 == inputParameters.size() || !ParseDuration(inputParameters[i + 1], timeoutSeconds))
+                            return incorrect_parameters;
+                        i++;
+                    } else if (ParseNumber(inputParameters[i], pid) && pid > 0) {
+                        pids.push_back((pid_t) pid);
+                    } else {
+                        return incorrect_parameters;
+                    }
+                }
+
+                return processHandler->WaitCommand(pids, any, timeoutSeconds);
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+        /**
+         * Show the PATH lookup table, clear it with -r, or pre-resolve names
+         */
+        class Hash : public Command {
+        public:
+            explicit Hash(Mysh *mysh, ProcessHandler *ph) {
+                this->mysh = mysh;
+                this->processHandler = ph;
+                this->keyword = "hash";
+                this->validParameters = {};
+                this->allowCustomParameters = true;
+            }
+
+            ErrorCode Execute(std::vector<std::string_view> &inputParameters) override {
+                if (inputParameters.empty()) {
+                    processHandler->pathCache.Print();
+                    return no_error;
+                }
+
+                if (inputParameters.size() == 1 && inputParameters[0] == "-r") {
+                    processHandler->pathCache.Clear();
+                    return no_error;
+                }
+
+                for (auto name : inputParameters) {
+                    if (processHandler->pathCache.Resolve(std::string(name)).empty()) {
+                        std::cout << "hash: " << name << " not found" << std::endl;
+                        mysh->lastStatus = 1;
+                    }
+                }
+                return no_error;
+            }
+
+        private:
+            ProcessHandler *processHandler;
+        };
+
+    public:
+        explicit ProcessHandler(Mysh *mysh) {
+            this->mysh = mysh;
+
+            // Each job's pidfd turns readable when it exits. Kernels before 5.3
+            // have no pidfds, there SIGCHLD is taken from a signalfd instead
+            childSignalFd = -1;
+            int probe = PidfdOpen(getpid());
+            pidfdSupported = probe != -1;
+            if (pidfdSupported)
+                close(probe);
+            else
+                OpenChildSignalFd();
+
+            const char *engine = getenv("MYSH_SPAWN_ENGINE");
+            spawnEngine = engine != nullptr && strcmp(engine, "fork") == 0 ? fork_engine : posix_spawn_engine;
+
+            mysh->commands.Register<RunForeground>(mysh, this);
+            mysh->commands.Register<RunBackground>(mysh, this);
+            mysh->commands.Register<ExterminatePID>(mysh, this);
+            mysh->commands.Register<ExterminateAll>(mysh, this);
+            mysh->commands.Register<Repeat>(mysh, this);
+            mysh->commands.Register<SelectSpawnEngine>(mysh, this);
+            mysh->commands.Register<Hash>(mysh, this);
+            mysh->commands.Register<Jobs>(mysh, this);
+            mysh->commands.Register<Wait>(mysh, this);
+            mysh->commands.Register<Time>(mysh, this);
+            mysh->commands.Register<Stats>(mysh, this);
+            mysh->commands.Register<Parallel>(mysh, this);
+            mysh->commands.Register<JobLog>(mysh, this);
+            mysh->commands.Register<Cached>(mysh, this);
+            mysh->commands.Register<Cache>(mysh, this);
+        }
+
+        ~ProcessHandler() {
+            for (Job &job : jobs) {
+                for (Process &process : job.processes)
+                    ReleasePidfd(process);
+            }
+
+            if (childSignalFd != -1) {
+                mysh->eventLoop->Remove(childSignalFd);
+                close(childSignalFd);
+            }
+
+            for (auto &[pid, capture] : captures)
+                CloseCapture(*capture);
+        }
+
+        int CountRunningProcesses() {
+            return jobs.Running();
+        }
+
+        // Reap whatever exited without waiting for the event loop
+        void ReapBackgroundPIDs() {
+            if (jobs.Running() > 0)
+                ReapExitedChildren();
+        }
+
+        // "[pid] done (status)" lines for jobs finished since the last prompt
+        void PrintNotices() {
+            std::string notices;
+            for (const Job &job : jobs) {
+                if (job.state != job_running)
+                    notices += "[" + std::to_string(job.pid) + "] done (" + DescribeWaitStatus(job.waitStatus) + ")\n";
+            }
+            std::cout << notices << std::flush;
+            jobs.RemoveFinished();
+        }
+
+        // The same lines for owner's jobs only, which are then dropped
+        std::string TakeNotices(uint64_t owner) {
+            std::string notices;
+            std::vector<pid_t> finished;
+            for (const Job &job : jobs) {
+                if (job.state != job_running && job.owner == owner) {
+                    notices += "[" + std::to_string(job.pid) + "] done (" + DescribeWaitStatus(job.waitStatus) + ")\n";
+                    finished.push_back(job.pid);
+                }
+            }
+            for (pid_t pid : finished)
+                jobs.Remove(pid);
+            return notices;
+        }
+
+        // Jobs started from now on belong to owner, see TakeNotices
+        void SetJobOwner(uint64_t owner) {
+            jobOwner = owner;
+        }
+
+    private:
+        Mysh *mysh;
+        JobTable jobs;
+        uint64_t jobOwner = 0;
+        bool pidfdSupported;
+        int childSignalFd;
+
+        static int PidfdOpen(pid_t pid) {
+            return (int) syscall(SYS_pidfd_open, pid, 0);
+        }
+
+        static int PidfdSendSignal(int pidfd, int sig) {
+            return (int) syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+        }
+
+        void OpenChildSignalFd() {
+            sigset_t childSignal;
+            sigemptyset(&childSignal);
+            sigaddset(&childSignal, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &childSignal, nullptr);
+
+            childSignalFd = signalfd(-1, &childSignal, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (childSignalFd == -1)
+                perror("signalfd");
+            else
+                mysh->eventLoop->Add(childSignalFd, EPOLLIN, [this](uint32_t) { OnChildSignal(); });
+        }
+
+        // pids are the pipeline stages in order, a single command has one
+        void TrackJob(const std::vector<pid_t> &pids, pid_t pgid, std::string commandLine) {
+            Job *job = jobs.Add(pids[0], pgid, std::move(commandLine));
+            job->owner = jobOwner;
+            for (size_t i = 1; i < pids.size(); i++)
+                job = jobs.AddProcess(job, pids[i]);
+
+            if (!pidfdSupported)
+                return;
+
+            // Not reaped yet, so each pid still names our child even if it already exited
+            for (Process &process : job->processes) {
+                pid_t pid = process.pid;
+                process.pidfd = PidfdOpen(pid);
+                if (process.pidfd != -1)
+                    mysh->eventLoop->Add(process.pidfd, EPOLLIN, [this, pid](uint32_t) { OnPidfdReady(pid); });
+                else if (childSignalFd == -1)
+                    OpenChildSignalFd();
+            }
+        }
+
+        void ReleasePidfd(Process &process) {
+            if (process.pidfd == -1)
+                return;
+            mysh->eventLoop->Remove(process.pidfd);
+            close(process.pidfd);
+            process.pidfd = -1;
+        }
+
+        bool IsRunningJob(pid_t pid) {
+            Job *job = jobs.Find(pid);
+            return job != nullptr && job->state == job_running;
+        }
+
+        void OnPidfdReady(pid_t pid) {
+            int wait_status;
+            if (WaitChild(pid, &wait_status, WNOHANG) == pid)
+                OnChildExit(pid, wait_status);
+        }
+
+        // waitpid() that also hands the child's rusage to accounting
+        pid_t WaitChild(pid_t pid, int *wait_status, int options) {
+            // Without a signalfd nothing else reaps behind our back while the loop runs
+            if (mysh->serving && !(options & WNOHANG) && childSignalFd == -1)
+                return ServeUntilChildExits(pid, wait_status, options);
+
+            struct rusage usage{};
+            pid_t reaped;
+            do {
+                reaped = wait4(pid, wait_status, options, &usage);
+            } while (reaped == -1 && errno == EINTR);
+
+            if (reaped > 0)
+                accounting.Finished(reaped, usage);
+            return reaped;
+        }
+
+        /**
+         * A blocking wait for a server: the event loop keeps accepting and
+         * reading the other clients' requests, so the time they spend queued
+         * behind this child shows up in their queue_us. A single child is
+         * waited for through its pidfd, any child by polling every millisecond.
+         */
+        pid_t ServeUntilChildExits(pid_t pid, int *wait_status, int options) {
+            int pidfd = pid > 0 ? PidfdOpen(pid) : -1;
+            if (pidfd != -1) {
+                bool exited = false;
+                mysh->eventLoop->Add(pidfd, EPOLLIN, [&exited](uint32_t) { exited = true; });
+                while (!exited)
+                    mysh->eventLoop->RunOnce(-1);
+                mysh->eventLoop->Remove(pidfd);
+                close(pidfd);
+            }
+
+            pid_t reaped;
+            while ((reaped = WaitChild(pid, wait_status, options | WNOHANG)) == 0)
+                mysh->eventLoop->RunOnce(1);
+            return reaped;
+        }
+
+        void OnChildSignal() {
+            struct signalfd_siginfo info{};
+            while (read(childSignalFd, &info, sizeof(info)) == sizeof(info));
+
+            ReapExitedChildren();
+        }
+
+        void ReapExitedChildren() {
+            // Signals coalesce, so reap everything that is ready
+            int wait_status;
+            pid_t pid;
+            while ((pid = WaitChild(-1, &wait_status, WNOHANG)) > 0)
+                OnChildExit(pid, wait_status);
+        }
+
+        void OnChildExit(pid_t pid, int wait_status) {
+            auto watched = watchedChildren.find(pid);
+            if (watched != watchedChildren.end()) {
+                WatchedChild child = std::move(watched->second);
+                watchedChildren.erase(watched);
+                if (child.pidfd != -1) {
+                    mysh->eventLoop->Remove(child.pidfd);
+                    close(child.pidfd);
+                }
+                child.onExit(wait_status);
+                return;
+            }
+
+            Job *job = jobs.Find(pid);
+            if (job == nullptr)
+                return;
+
+            Process *process = job->FindProcess(pid);
+            if (process != nullptr)
+                ReleasePidfd(*process);
+            jobs.MarkProcessFinished(job, pid, wait_status);
+        }
+
+        void ListJobs() {
+            auto now = std::chrono::steady_clock::now();
+            std::string out;
+            char row[128];
+
+            snprintf(row, sizeof(row), "%-8s %-8s %-20s %9s  %s\n", "PID", "PGID", "STATE", "TIME", "COMMAND");
+            out += row;
+
+            for (const Job &job : jobs) {
+                auto end = job.state == job_running ? now : job.endTime;
+                std::string state = job.state == job_running ? "running" : DescribeWaitStatus(job.waitStatus);
+
+                snprintf(row, sizeof(row), "%-8ld %-8ld %-20s %8.1fs  ", (long) job.pid, (long) job.pgid,
+                         state.c_str(), std::chrono::duration<double>(end - job.startTime).count());
+                out += row;
+                out += job.commandLine;
+                out += '\n';
+            }
+
+            std::cout << out << std::flush;
+            jobs.RemoveFinished();
+        }
+
+        static std::string DescribeWaitStatus(int wait_status) {
+            if (WIFEXITED(wait_status))
+                return "exit " + std::to_string(WEXITSTATUS(wait_status));
+            if (WIFSIGNALED(wait_status))
+                return std::string("signal ") + strsignal(WTERMSIG(wait_status));
+            return "unknown";
+        }
+
+        /**
+         * Maps a command name to the absolute path PATH resolves it to, so a
+         * launch costs one stat of the directory it came from instead of an
+         * execve attempt in every PATH directory. An entry is dropped when its
+         * directory's mtime changes, the whole table when PATH changes.
+         */
+        class PathCache {
+        public:
+            struct Entry {
+                std::string path;
+                size_t directory;
+                struct timespec directoryMtime;
+                unsigned long hits;
+            };
+
+            // Empty if name is not an executable in any PATH directory
+            const std::string &Resolve(const std::string &name) {
+                static const std::string notFound;
+
+                SyncWithPath();
+
+                auto it = entries.find(name);
+                if (it != entries.end()) {
+                    struct stat st{};
+                    if (stat(directories[it->second.directory].c_str(), &st) == 0 &&
+                        SameTime(st.st_mtim, it->second.directoryMtime)) {
+                        it->second.hits++;
+                        return it->second.path;
+                    }
+                    entries.erase(it);
+                }
+
+                for (size_t i = 0; i < directories.size(); i++) {
+                    const std::string &directory = directories[i];
+                    std::string candidate = (directory.empty() ? "." : directory) + "/" + name;
+
+                    struct stat st{};
+                    if (stat(candidate.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+                        access(candidate.c_str(), X_OK) != 0)
+                        continue;
+
+                    // Relative entries depend on the current directory, never cache them
+                    struct stat dirSt{};
+                    if (directory.empty() || directory[0] != '/' || stat(directory.c_str(), &dirSt) != 0) {
+                        uncached = candidate;
+                        return uncached;
+                    }
+
+                    Entry &entry = entries[name];
+                    entry = {candidate, i, dirSt.st_mtim, 1};
+                    return entry.path;
+                }
+
+                return notFound;
+            }
+
+            void Clear() {
+                entries.clear();
+            }
+
+            void Print() {
+                SyncWithPath();
+
+                if (entries.empty()) {
+                    std::cout << "hash table empty" << std::endl;
+                    return;
+                }
+
+                std::string out = "hits\tcommand\n";
+                for (const auto &[name, entry] : entries) {
+                    out += std::to_string(entry.hits);
+                    out += '\t';
+                    out += entry.path;
+                    out += '\n';
+                }
+                std::cout << out << std::flush;
+            }
+
+        private:
+            std::string pathVariable;
+            std::vector<std::string> directories;
+            std::unordered_map<std::string, Entry> entries;
+            std::string uncached;
+
+            static bool SameTime(const struct timespec &a, const struct timespec &b) {
+                return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+            }
+
+            void SyncWithPath() {
+                const char *path = getenv("PATH");
+                if (path == nullptr)
+                    path = "/usr/local/bin:/usr/bin:/bin";
+
+                if (pathVariable == path && !directories.empty())
+                    return;
+
+                pathVariable = path;
+                directories.clear();
+                entries.clear();
+
+                size_t start = 0;
+                while (true) {
+                    size_t colon = pathVariable.find(':', start);
+                    directories.push_back(pathVariable.substr(start, colon - start));
+                    if (colon == std::string::npos)
+                        break;
+                    start = colon + 1;
+                }
+            }
+        };
+
+        /**
+         * How children are started. Fork copies the page tables of the whole
+         * shell, posix_spawn starts the child with a vfork-style clone and is
+         * the default; both are kept so they can be compared.
+         */
+        enum SpawnEngine {
+            fork_engine,
+            posix_spawn_engine,
+        };
+
+        // dup2(fd, target) in the child
+        struct FdRedirect {
+            int fd;
+            int target;
+        };
+
+        struct LaunchOptions {
+            // Put the child in its own process group, like background jobs
+            bool newProcessGroup = false;
+            // Otherwise join this process group, 0 to stay in the shell's
+            pid_t processGroup = 0;
+            // Applied in order, the fds themselves are O_CLOEXEC
+            std::vector<FdRedirect> redirects;
+            // Files opened for redirects, closed by the shell after the launch
+            std::vector<int> openedFds;
+            // Applied in the child right before exec, see ParseResourceOptions
+            bool pinCpus = false;
+            cpu_set_t cpus{};
+            bool renice = false;
+            int niceness = 0;
+            std::vector<std::pair<int, rlim_t>> limits;
+
+            // posix_spawn has no hook for these, so they need a real fork
+            bool NeedsFork() const {
+                return pinCpus || renice || !limits.empty();
+            }
+        };
+
+        SpawnEngine spawnEngine;
+        PathCache pathCache;
+        Accounting accounting;
+        ResultCache resultCache;
+
+        /**
+         * The newest bytes a job wrote, in a buffer of fixed size. Older bytes
+         * are overwritten and only counted, so memory per job never grows.
+         */
+        class OutputRing {
+        public:
+            explicit OutputRing(size_t capacity) : buffer(capacity, '\0') {}
+
+            void Append(const char *data, size_t size) {
+                size_t capacity = buffer.size();
+                written += size;
+                if (size > capacity) {
+                    data += size - capacity;
+                    size = capacity;
+                }
+
+                size_t end = (first + length) % capacity;
+                size_t part = std::min(size, capacity - end);
+                memcpy(&buffer[end], data, part);
+                memcpy(&buffer[0], data + part, size - part);
+
+                length += size;
+                if (length > capacity) {
+                    first = (first + length - capacity) % capacity;
+                    length = capacity;
+                }
+            }
+
+            // Oldest first
+            void AppendTo(std::string &out) const {
+                size_t part = std::min(length, buffer.size() - first);
+                out.append(buffer, first, part);
+                out.append(buffer, 0, length - part);
+            }
+
+            size_t Dropped() const {
+                return written - length;
+            }
+
+        private:
+            std::string buffer;
+            size_t first = 0;
+            size_t length = 0;
+            size_t written = 0;
+        };
+
+        struct Capture {
+            explicit Capture(size_t capacity) : ring(capacity) {}
+
+            int fd = -1;
+            int logFd = -1;
+            std::string logPath;
+            OutputRing ring;
+            bool following = false;
+        };
+
+        static constexpr size_t CAPTURE_BYTES = 256 * 1024;
+        // Finished jobs whose output is still kept for joblog
+        static constexpr size_t KEPT_CAPTURES = 16;
+
+        std::unordered_map<pid_t, std::unique_ptr<Capture>> captures;
+        std::deque<std::pair<pid_t, Capture *>> closedCaptures;
+
+        // Children that are not jobs but still reaped by OnChildExit, see WatchChild
+        struct WatchedChild {
+            int pidfd;
+            std::function<void(int wait_status)> onExit;
+        };
+
+        std::unordered_map<pid_t, WatchedChild> watchedChildren;
+
+        /**
+         * Has onExit called with the wait status once pid is reaped. Its pidfd
+         * wakes the shell's event loop the moment it exits, as for background
+         * jobs, or the SIGCHLD signalfd where there are no pidfds.
+         */
+        void WatchChild(pid_t pid, std::function<void(int wait_status)> onExit) {
+            int pidfd = pidfdSupported ? PidfdOpen(pid) : -1;
+            if (pidfd != -1)
+                mysh->eventLoop->Add(pidfd, EPOLLIN, [this, pid](uint32_t) { OnPidfdReady(pid); });
+            else if (childSignalFd == -1)
+                OpenChildSignalFd();
+            watchedChildren[pid] = {pidfd, std::move(onExit)};
+        }
+
+        // Without pidfds or a signalfd, exits are only noticed by polling on every wakeup
+        void PollWatchedChildren() {
+            if (!pidfdSupported && childSignalFd == -1)
+                ReapExitedChildren();
+        }
+
+        // The copies a repeat --rate still has running, and what the finished ones took
+        struct PacedRun {
+            struct Copy {
+                std::chrono::steady_clock::time_point due;
+                std::chrono::steady_clock::time_point started;
+            };
+
+            std::unordered_map<pid_t, Copy> inFlight;
+            // Microseconds from when the copy was due, so launches held back still count
+            Histogram latency;
+            // Microseconds from when it was actually started
+            Histogram service;
+            long succeeded = 0;
+            long failed = 0;
+
+            void Finished(pid_t pid, int wait_status) {
+                auto it = inFlight.find(pid);
+                if (it == inFlight.end())
+                    return;
+
+                auto now = std::chrono::steady_clock::now();
+                latency.Record(std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.due).count());
+                service.Record(std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.started).count());
+                if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)
+                    succeeded++;
+                else
+                    failed++;
+                inFlight.erase(it);
+            }
+        };
+
+        // stdout and stderr of the job share one pipe, so their order is kept
+        static bool OpenCapture(int captureFds[2], LaunchOptions &options) {
+            if (pipe2(captureFds, O_CLOEXEC) == -1) {
+                perror("pipe2");
+                return false;
+            }
+            // A larger pipe lets the job run on while the shell is busy in the foreground
+            fcntl(captureFds[0], F_SETPIPE_SZ, 1 << 20);
+            fcntl(captureFds[0], F_SETFL, O_NONBLOCK);
+            options.redirects.insert(options.redirects.begin(),
+                                     {{captureFds[1], STDOUT_FILENO}, {captureFds[1], STDERR_FILENO}});
+            return true;
+        }
+
+        void AttachCapture(pid_t pid, int captureFds[2], const std::string &logPath) {
+            close(captureFds[1]);
+            if (pid <= 0) {
+                close(captureFds[0]);
+                return;
+            }
+
+            auto capture = std::make_unique<Capture>(CAPTURE_BYTES);
+            capture->fd = captureFds[0];
+            if (!logPath.empty()) {
+                capture->logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (capture->logFd == -1)
+                    perror(logPath.c_str());
+                else
+                    capture->logPath = logPath;
+            }
+
+            Capture *raw = capture.get();
+            if (!mysh->eventLoop->Add(raw->fd, EPOLLIN, [this, raw](uint32_t) { DrainCapture(*raw); })) {
+                perror("epoll_ctl");
+                CloseCapture(*raw);
+            }
+
+            // A pid the kernel reused replaces the old job's output, and its place
+            // in closedCaptures, which would otherwise outlive the Capture it points to
+            auto it = captures.find(pid);
+            if (it != captures.end()) {
+                CloseCapture(*it->second);
+                closedCaptures.erase(std::remove_if(closedCaptures.begin(), closedCaptures.end(),
+                                                    [pid](const auto &closed) { return closed.first == pid; }),
+                                     closedCaptures.end());
+            }
+            captures[pid] = std::move(capture);
+        }
+
+        // Reads what is there now, a bounded number of times so a chatty job cannot starve the prompt
+        void DrainCapture(Capture &capture) {
+            char chunk[65536];
+            for (int i = 0; i < 16 && capture.fd != -1; i++) {
+                ssize_t n = read(capture.fd, chunk, sizeof(chunk));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && errno == EAGAIN)
+                    return;
+                if (n <= 0) {
+                    CloseCapture(capture);
+                    ForgetOldCaptures(capture);
+                    return;
+                }
+
+                capture.ring.Append(chunk, n);
+                if (capture.logFd != -1 && !WriteAll(capture.logFd, chunk, n)) {
+                    perror(capture.logPath.c_str());
+                    close(capture.logFd);
+                    capture.logFd = -1;
+                }
+                if (capture.following) {
+                    FlushOutput();
+                    WriteAll(STDOUT_FILENO, chunk, n);
+                }
+            }
+        }
+
+        void CloseCapture(Capture &capture) {
+            if (capture.fd != -1) {
+                mysh->eventLoop->Remove(capture.fd);
+                close(capture.fd);
+                capture.fd = -1;
+            }
+            if (capture.logFd != -1) {
+                close(capture.logFd);
+                capture.logFd = -1;
+            }
+        }
+
+        void ForgetOldCaptures(Capture &closed) {
+            for (auto &[pid, capture] : captures) {
+                if (capture.get() == &closed) {
+                    closedCaptures.emplace_back(pid, capture.get());
+                    break;
+                }
+            }
+
+            while (closedCaptures.size() > KEPT_CAPTURES) {
+                auto [pid, oldest] = closedCaptures.front();
+                closedCaptures.pop_front();
+                auto it = captures.find(pid);
+                if (it != captures.end() && it->second.get() == oldest)
+                    captures.erase(it);
+            }
+        }
+
+        bool PrintCapture(pid_t pid, bool follow) {
+            auto it = captures.find(pid);
+            if (it == captures.end())
+                return false;
+            Capture &capture = *it->second;
+
+            // The event loop only runs at the prompt, batch mode drains here
+            if (capture.fd != -1)
+                DrainCapture(capture);
+
+            if (capture.ring.Dropped() > 0) {
+                std::cerr << "joblog: " << capture.ring.Dropped() << " earlier bytes dropped";
+                if (!capture.logPath.empty())
+                    std::cerr << ", all of it is in " << capture.logPath;
+                std::cerr << std::endl;
+            }
+
+            std::string out;
+            capture.ring.AppendTo(out);
+            FlushOutput();
+            WriteAll(STDOUT_FILENO, out.data(), out.size());
+
+            if (follow && capture.fd != -1) {
+                capture.following = true;
+                // Closing also drops the capture from the loop, which ends this
+                Capture *followed = &capture;
+                while (followed->fd != -1)
+                    mysh->eventLoop->RunOnce(-1);
+                followed->following = false;
+            }
+            return true;
+        }
+
+        /**
+         * Starts arguments[0] from PATH and returns its pid once exec has
+         * succeeded. Returns -1 if it could not be started, with the reason
+         * already printed.
+         */
+        pid_t Launch(char **arguments, const LaunchOptions &options) {
+            FlushOutput();
+
+            // Names with a slash are paths already, everything else goes through PATH
+            const char *path = arguments[0];
+            if (strchr(arguments[0], '/') == nullptr) {
+                path = pathCache.Resolve(arguments[0]).c_str();
+                if (*path == '\0') {
+                    std::cerr << "could not execute " << arguments[0] << ": command not found" << std::endl;
+                    return -1;
+                }
+            }
+
+            pid_t pid;
+            auto start = std::chrono::steady_clock::now();
+            int error = spawnEngine == fork_engine || options.NeedsFork()
+                        ? ForkExec(path, arguments, options, &pid)
+                        : PosixSpawn(path, arguments, options, &pid);
+
+            if (error != 0) {
+                std::cerr << "could not execute " << arguments[0] << ": " << strerror(error) << std::endl;
+                return -1;
+            }
+
+            // Both engines return only once exec succeeded, so this is fork to exec
+            accounting.Started(pid, arguments[0], start, std::chrono::steady_clock::now() - start);
+            return pid;
+        }
+
+        // Exec errors come back through a close-on-exec pipe: it reads EOF once
+        // exec succeeded, or the child's errno if it did not
+        static int ForkExec(const char *path, char **arguments, const LaunchOptions &options, pid_t *pid) {
+            int errorPipe[2];
+            if (pipe2(errorPipe, O_CLOEXEC) == -1)
+                return errno;
+
+            pid_t c_pid = fork();
+
+            if (c_pid < 0) {
+                int error = errno;
+                close(errorPipe[0]);
+                close(errorPipe[1]);
+                return error;
+            }
+
+            if (c_pid == 0) {
+                close(errorPipe[0]);
+
+                int error = SetUpChild(options);
+                if (error == 0) {
+                    execv(path, arguments);
+                    error = errno;
+                }
+
+                ssize_t ignored = write(errorPipe[1], &error, sizeof(error));
+                (void) ignored;
+                _exit(127);
+            }
+
+            close(errorPipe[1]);
+
+            int error = 0;
+            ssize_t n;
+            do {
+                n = read(errorPipe[0], &error, sizeof(error));
+            } while (n < 0 && errno == EINTR);
+            close(errorPipe[0]);
+
+            if (n == sizeof(error)) {
+                waitpid(c_pid, nullptr, 0);
+                return error;
+            }
+
+            *pid = c_pid;
+            return 0;
+        }
+
+        // The signal mask both spawn engines give children. The shell may block
+        // SIGCHLD for its signalfd, children must not inherit that
+        static void ChildSignalMask(sigset_t *mask) {
+            sigemptyset(mask);
+        }
+
+        // Everything a forked child does before exec, returns an errno on failure
+        static int SetUpChild(const LaunchOptions &options) {
+            sigset_t mask;
+            ChildSignalMask(&mask);
+            sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+            // Set new process group to stop capturing input from caller shell
+            if (options.newProcessGroup)
+                setpgid(0, 0);
+            else if (options.processGroup != 0)
+                setpgid(0, options.processGroup);
+
+            for (const FdRedirect &redirect : options.redirects) {
+                if (dup2(redirect.fd, redirect.target) == -1)
+                    return errno;
+            }
+
+            if (options.pinCpus && sched_setaffinity(0, sizeof(options.cpus), &options.cpus) == -1)
+                return errno;
+            if (options.renice && setpriority(PRIO_PROCESS, 0, options.niceness) == -1)
+                return errno;
+            for (const auto &[resource, value] : options.limits) {
+                struct rlimit limit{value, value};
+                if (setrlimit(resource, &limit) == -1)
+                    return errno;
+            }
+            return 0;
+        }
+
+        // glibc reports exec failures as the return value, it runs the child
+        // on a CLONE_VM | CLONE_VFORK clone and passes the errno back itself
+        static int PosixSpawn(const char *path, char **arguments, const LaunchOptions &options, pid_t *pid) {
+            posix_spawnattr_t attributes;
+            posix_spawnattr_init(&attributes);
+
+            sigset_t mask;
+            ChildSignalMask(&mask);
+            posix_spawnattr_setsigmask(&attributes, &mask);
+            short flags = POSIX_SPAWN_SETSIGMASK;
+
+            if (options.newProcessGroup || options.processGroup != 0) {
+                flags |= POSIX_SPAWN_SETPGROUP;
+                posix_spawnattr_setpgroup(&attributes, options.newProcessGroup ? 0 : options.processGroup);
+            }
+            posix_spawnattr_setflags(&attributes, flags);
+
+            posix_spawn_file_actions_t fileActions;
+            posix_spawn_file_actions_init(&fileActions);
+            for (const FdRedirect &redirect : options.redirects)
+                posix_spawn_file_actions_adddup2(&fileActions, redirect.fd, redirect.target);
+
+            int error = posix_spawn(pid, path, &fileActions, &attributes, arguments, environ);
+
+            posix_spawn_file_actions_destroy(&fileActions);
+            posix_spawnattr_destroy(&attributes);
+            return error;
+        }
+
+        ErrorCode ForkExecWait(char **arguments, const LaunchOptions &options, int *exitStatus) {
+            pid_t c_pid, w;
+            int wait_status;
+
+            c_pid = Launch(arguments, options);
+
+            if (c_pid < 0) {
+                *exitStatus = 127;
+                return no_error;
+            }
+
+            w = WaitChild(c_pid, &wait_status, 0);
+
+            if (w == -1) {
+                perror("waitpid");
+                return child_process_error;
+            }
+
+            *exitStatus = ExitStatusOf(wait_status);
+
+            return no_error;
+        }
+
+        // Shell convention: the exit code, or 128 + signal number
+        static int ExitStatusOf(int wait_status) {
+            if (WIFSIGNALED(wait_status))
+                return 128 + WTERMSIG(wait_status);
+            return WEXITSTATUS(wait_status);
+        }
+
+        // Anything still buffered would otherwise show up after the child's output,
+        // or twice if a forked child flushed it too
+        static void FlushOutput() {
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(nullptr);
+        }
+
+        /**
+         * Takes <, >, >>, 2> and 2>&1 with their file names out of parameters,
+         * opens the files O_CLOEXEC and queues the matching dup2s in options.
+         * Prints why and returns false if a file cannot be opened.
+         */
+        static bool ParseRedirections(std::vector<std::string_view> &parameters, LaunchOptions &options) {
+            size_t kept = 0;
+
+            for (size_t i = 0; i < parameters.size(); i++) {
+                std::string_view token = parameters[i];
+
+                if (Tokenizer::IsOperator(token, Tokenizer::ERROR_TO_OUTPUT)) {
+                    options.redirects.push_back({STDOUT_FILENO, STDERR_FILENO});
+                    continue;
+                }
+
+                int target, flags;
+                if (Tokenizer::IsOperator(token, Tokenizer::INPUT)) {
+                    target = STDIN_FILENO;
+                    flags = O_RDONLY;
+                } else if (Tokenizer::IsOperator(token, Tokenizer::OUTPUT)) {
+                    target = STDOUT_FILENO;
+                    flags = O_WRONLY | O_CREAT | O_TRUNC;
+                } else if (Tokenizer::IsOperator(token, Tokenizer::APPEND)) {
+                    target = STDOUT_FILENO;
+                    flags = O_WRONLY | O_CREAT | O_APPEND;
+                } else if (Tokenizer::IsOperator(token, Tokenizer::ERROR)) {
+                    target = STDERR_FILENO;
+                    flags = O_WRONLY | O_CREAT | O_TRUNC;
+                } else {
+                    parameters[kept++] = token;
+                    continue;
+                }
+
+                if (i + 1 == parameters.size() || Tokenizer::IsOperator(parameters[i + 1])) {
+                    std::cerr << "missing file name after " << token << std::endl;
+                    return false;
+                }
+
+                std::string path(parameters[++i]);
+                int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+                if (fd == -1) {
+                    perror(path.c_str());
+                    return false;
+                }
+                options.openedFds.push_back(fd);
+                options.redirects.push_back({fd, target});
+            }
+
+            parameters.resize(kept);
+            return true;
+        }
+
+        /**
+         * Takes leading --cpus LIST, --nice N, --mem SIZE and --nofile N off
+         * the parameters. LIST is like "2-5,8", SIZE takes a K/M/G suffix.
+         */
+        static bool ParseResourceOptions(std::vector<std::string_view> &parameters, LaunchOptions &options) {
+            size_t i = 0;
+            int consumed;
+            while ((consumed = ParseResourceOption(parameters, i, options)) > 0)
+                i += consumed;
+
+            parameters.erase(parameters.begin(), parameters.begin() + i);
+            return consumed == 0;
+        }
+
+        // Tokens used by the option at parameters[i]: 0 if it is none, -1 if it is invalid
+        static int ParseResourceOption(const std::vector<std::string_view> &parameters, size_t i,
+                                       LaunchOptions &options) {
+            std::string_view option = parameters[i];
+            if (option != "--cpus" && option != "--nice" && option != "--mem" && option != "--nofile")
+                return 0;
+
+            // options only change once the value is known to be good
+            long number = 0;
+            cpu_set_t cpus;
+            std::string_view value = i + 1 < parameters.size() ? parameters[i + 1] : std::string_view();
+            bool valid;
+            if (option == "--cpus")
+                valid = ParseCpuList(value, cpus);
+            else if (option == "--nice")
+                valid = ParseNumber(value, number) && number >= -20 && number <= 19;
+            else if (option == "--mem")
+                valid = ParseSize(value, number);
+            else
+                valid = ParseNumber(value, number) && number > 0;
+
+            if (!valid) {
+                std::cerr << "invalid value for " << option << ": " << value << std::endl;
+                return -1;
+            }
+
+            if (option == "--cpus") {
+                options.cpus = cpus;
+                options.pinCpus = true;
+            } else if (option == "--nice") {
+                options.renice = true;
+                options.niceness = (int) number;
+            } else if (option == "--mem") {
+                options.limits.emplace_back(RLIMIT_AS, (rlim_t) number);
+            } else {
+                options.limits.emplace_back(RLIMIT_NOFILE, (rlim_t) number);
+            }
+            return 2;
+        }
+
+        static bool ParseCpuList(std::string_view list, cpu_set_t &cpus) {
+            CPU_ZERO(&cpus);
+            while (!list.empty()) {
+                size_t comma = list.find(',');
+                std::string_view range = list.substr(0, comma);
+                list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+                size_t dash = range.find('-');
+                long first, last;
+                if (!ParseNumber(range.substr(0, dash), first))
+                    return false;
+                last = first;
+                if (dash != std::string_view::npos && !ParseNumber(range.substr(dash + 1), last))
+                    return false;
+                if (first < 0 || last < first || last >= std::min<long>(CPU_SETSIZE, sysconf(_SC_NPROCESSORS_CONF)))
+                    return false;
+
+                for (long cpu = first; cpu <= last; cpu++)
+                    CPU_SET(cpu, &cpus);
+            }
+            return CPU_COUNT(&cpus) > 0;
+        }
+
+        static bool ParseSize(std::string_view text, long &bytes) {
+            long scale = 1;
+            if (!text.empty()) {
+                switch (text.back()) {
+                    case 'K': case 'k': scale = 1L << 10; break;
+                    case 'M': case 'm': scale = 1L << 20; break;
+                    case 'G': case 'g': scale = 1L << 30; break;
+                    default: break;
+                }
+                if (scale != 1)
+                    text.remove_suffix(1);
+            }
+            if (!ParseNumber(text, bytes) || bytes <= 0 || bytes > LONG_MAX / scale)
+                return false;
+            bytes *= scale;
+            return true;
+        }
+
+        static void CloseRedirections(LaunchOptions &options) {
+            for (int fd : options.openedFds)
+                close(fd);
+            options.openedFds.clear();
+        }
+
+        static bool HasPipe(const std::vector<std::string_view> &inputParameters) {
+            for (auto parameter : inputParameters) {
+                if (Tokenizer::IsOperator(parameter, Tokenizer::PIPE))
+                    return true;
+            }
+            return false;
+        }
+
+        /**
+         * Starts parameters as a pipeline, stages split at |, joined by
+         * O_CLOEXEC pipes. Background pipelines get one process group led by
+         * the first stage; foreground ones stay in the shell's group like a
+         * plain run. Returns the stage pids in order, or an empty vector if
+         * the pipeline is malformed or a stage could not start.
+         */
+        std::vector<pid_t> LaunchPipeline(const std::vector<std::string_view> &parameters, bool background,
+                                          const LaunchOptions &resources) {
+            std::vector<std::vector<std::string_view>> stages(1);
+            for (auto parameter : parameters) {
+                if (Tokenizer::IsOperator(parameter, Tokenizer::PIPE))
+                    stages.emplace_back();
+                else
+                    stages.back().push_back(parameter);
+            }
+
+            std::vector<pid_t> pids;
+            for (const auto &stage : stages) {
+                if (stage.empty()) {
+                    std::cerr << "empty pipeline stage" << std::endl;
+                    return pids;
+                }
+            }
+
+            int previousRead = -1;
+            bool failed = false;
+
+            for (size_t i = 0; i < stages.size() && !failed; i++) {
+                LaunchOptions options = resources;
+                options.newProcessGroup = background && i == 0;
+                options.processGroup = background && i > 0 ? pids[0] : 0;
+
+                int pipeFds[2] = {-1, -1};
+                if (i + 1 < stages.size() && pipe2(pipeFds, O_CLOEXEC) == -1) {
+                    perror("pipe2");
+                    failed = true;
+                    break;
+                }
+
+                if (previousRead != -1)
+                    options.redirects.push_back({previousRead, STDIN_FILENO});
+                if (pipeFds[1] != -1)
+                    options.redirects.push_back({pipeFds[1], STDOUT_FILENO});
+
+                // Applied after the pipe ends, so a stage's own redirect wins
+                pid_t pid = -1;
+                bool parsed = ParseRedirections(stages[i], options);
+                if (parsed && stages[i].empty()) {
+                    std::cerr << "empty pipeline stage" << std::endl;
+                } else if (parsed && stages[i][0] == "tap") {
+                    pid = stages[i].size() == 2 ? LaunchTap(std::string(stages[i][1]), options) : -1;
+                    if (stages[i].size() != 2)
+                        std::cerr << "usage: tap FILE" << std::endl;
+                } else if (parsed) {
+                    char **arguments = InputParametersToCharArguments(stages[i]);
+                    pid = Launch(arguments, options);
+                    FreeCharArguments(arguments);
+                }
+                CloseRedirections(options);
+
+                // The children hold their own copies now
+                if (previousRead != -1)
+                    close(previousRead);
+                if (pipeFds[1] != -1)
+                    close(pipeFds[1]);
+                previousRead = pipeFds[0];
+
+                if (pid < 0)
+                    failed = true;
+                else
+                    pids.push_back(pid);
+            }
+
+            if (previousRead != -1)
+                close(previousRead);
+
+            if (failed) {
+                // Stages already running would otherwise wait on the missing one
+                for (pid_t pid : pids)
+                    kill(pid, SIGTERM);
+                int wait_status;
+                for (pid_t pid : pids)
+                    WaitChild(pid, &wait_status, 0);
+                pids.clear();
+            }
+            return pids;
+        }
+
+        /**
+         * A pipeline stage the shell runs itself: copies stdin to stdout and
+         * into path. tee(2) duplicates the pipe contents without consuming
+         * them, splice(2) then moves the same bytes into the file, so the data
+         * never passes through user space. Falls back to read/write when
+         * either side is not a pipe.
+         */
+        pid_t LaunchTap(const std::string &path, const LaunchOptions &options) {
+            int fileFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fileFd == -1) {
+                perror(path.c_str());
+                return -1;
+            }
+
+            FlushOutput();
+            auto start = std::chrono::steady_clock::now();
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                if (SetUpChild(options) != 0)
+                    _exit(127);
+                // No exec follows, so O_CLOEXEC never drops the other stages' pipe ends here, and
+                // a read end of our own output would keep tee from ever seeing EPIPE
+                CloseFdsExcept(fileFd);
+                _exit(CopyWithTap(fileFd));
+            }
+
+            if (pid < 0)
+                perror("fork");
+            else
+                accounting.Started(pid, "tap", start, std::chrono::steady_clock::now() - start);
+            close(fileFd);
+            return pid;
+        }
+
+        // Closes every fd above stderr but keep
+        static void CloseFdsExcept(int keep) {
+#ifdef SYS_close_range
+            if ((keep <= 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0) &&
+                syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+                return;
+#endif
+            // Kernels before 5.9: whatever /proc lists, collected first so the listing stays stable
+            std::vector<int> open;
+            DIR *fds = opendir("/proc/self/fd");
+            if (fds == nullptr)
+                return;
+            while (struct dirent *entry = readdir(fds)) {
+                int fd = atoi(entry->d_name);
+                if (fd > 2 && fd != keep && fd != dirfd(fds))
+                    open.push_back(fd);
+            }
+            closedir(fds);
+            for (int fd : open)
+                close(fd);
+        }
+
+        static int CopyWithTap(int fileFd) {
+            static constexpr size_t TAPCHUNK = 1 << 20;
+
+            while (true) {
+                ssize_t n = tee(STDIN_FILENO, STDOUT_FILENO, TAPCHUNK, 0);
+                if (n == 0)
+                    return 0;
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EINVAL)
+                        break;
+                    return 1;
+                }
+
+                while (n > 0) {
+                    ssize_t moved = splice(STDIN_FILENO, nullptr, fileFd, nullptr, n, SPLICE_F_MOVE);
+                    if (moved < 0 && errno == EINTR)
+                        continue;
+                    if (moved <= 0) {
+                        // The file system cannot splice, consume the teed bytes by hand
+                        char buffer[64 * 1024];
+                        moved = read(STDIN_FILENO, buffer, std::min<size_t>(n, sizeof(buffer)));
+                        if (moved <= 0 || !WriteAll(fileFd, buffer, moved))
+                            return 1;
+                    }
+                    n -= moved;
+                }
+            }
+
+            char buffer[64 * 1024];
+            ssize_t n;
+            while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return 1;
+                }
+                if (!WriteAll(STDOUT_FILENO, buffer, n) || !WriteAll(fileFd, buffer, n))
+                    return 1;
+            }
+            return 0;
+        }
+
+        static bool WriteAll(int fd, const char *data, size_t size) {
+            while (size > 0) {
+                ssize_t n = write(fd, data, size);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        ErrorCode RunPipeline(std::vector<std::string_view> &inputParameters, bool background,
+                              const LaunchOptions &resources, pid_t *leader = nullptr) {
+            std::vector<pid_t> pids = LaunchPipeline(inputParameters, background, resources);
+
+            if (pids.empty()) {
+                mysh->lastStatus = 127;
+                return no_error;
+            }
+
+            if (leader != nullptr)
+                *leader = pids[0];
+
+            if (background) {
+                printf("child (pid:%ld)\n", (long) pids[0]);
+                TrackJob(pids, pids[0], JoinParameters(inputParameters));
+                return no_error;
+            }
+
+            // Like other shells, the pipeline's status is the last stage's
+            int wait_status = 0;
+            for (pid_t pid : pids) {
+                WaitChild(pid, &wait_status, 0);
+            }
+            mysh->lastStatus = ExitStatusOf(wait_status);
+            return no_error;
+        }
+
+        ErrorCode ForkExecBackground(char **arguments, LaunchOptions options, pid_t *pid) {
+            options.newProcessGroup = true;
+
+            *pid = Launch(arguments, options);
+
+            return no_error;
+        }
+
+        // Tracked jobs are signalled through their pidfd, so a recycled pid is never hit
+        int SendSignal(pid_t pid, int sig) {
+            Job *job = jobs.Find(pid);
+            Process *process = job != nullptr ? job->FindProcess(pid) : nullptr;
+            // Reaped already, the pid may belong to someone else by now
+            if (process != nullptr && !process->running) {
+                errno = ESRCH;
+                return -1;
+            }
+            if (process != nullptr && process->pidfd != -1)
+                return PidfdSendSignal(process->pidfd, sig);
+            // Tracked but not reaped holds the pid as a zombie, untracked pids are the user's call
+            return kill(pid, sig);
+        }
+
+        // A process of ours that exited and was reaped, but not reported yet
+        bool IsReapedProcess(pid_t pid) {
+            Job *job = jobs.Find(pid);
+            Process *process = job != nullptr ? job->FindProcess(pid) : nullptr;
+            return process != nullptr && !process->running;
+        }
+
+        struct Escalation {
+            ErrorCode errorCode = no_error;
+            size_t alreadyDead = 0;
+            // Outlived SIGTERM, and of those, outlived the wait after SIGKILL too
+            std::vector<pid_t> killed;
+            std::vector<pid_t> exiting;
+            // A signal to these could not be sent, so they were not waited for
+            std::vector<pid_t> failed;
+            double seconds = 0;
+        };
+
+        /**
+         * SIGTERM every target, up to graceSeconds for wait to see them gone,
+         * then SIGKILL the rest and as long again for those. A target still
+         * there after that, or a signal that could not be sent, is an error;
+         * a target that could not be signalled is dropped from the waits.
+         */
+        Escalation Escalate(const std::vector<pid_t> &targets, double graceSeconds,
+                            const std::function<int(pid_t, int)> &signal,
+                            const std::function<std::vector<pid_t>(const std::vector<pid_t> &, double)> &wait) {
+            Escalation result;
+            auto start = std::chrono::steady_clock::now();
+
+            std::vector<pid_t> signalled;
+            for (pid_t pid : targets) {
+                if (signal(pid, SIGTERM) == 0)
+                    signalled.push_back(pid);
+                else if (errno == ESRCH)
+                    result.alreadyDead++;
+                else
+                    result.failed.push_back(pid);
+            }
+
+            std::vector<pid_t> remaining;
+            if (!signalled.empty())
+                remaining = wait(signalled, graceSeconds);
+            for (pid_t pid : remaining) {
+                if (signal(pid, SIGKILL) == 0 || errno == ESRCH)
+                    result.killed.push_back(pid);
+                else
+                    result.failed.push_back(pid);
+            }
+            // SIGKILL cannot be caught, this only waits for the kernel to tear them down
+            if (!result.killed.empty())
+                result.exiting = wait(result.killed, graceSeconds);
+            if (!result.exiting.empty() || !result.failed.empty())
+                result.errorCode = could_not_kill;
+
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        /**
+         * exterminateall for a single process. Someone else's process is held
+         * by a pidfd of our own, so neither signal can hit a recycled pid.
+         */
+        ErrorCode KillPID(pid_t pid, double graceSeconds) {
+            int pidfd = jobs.Find(pid) == nullptr ? PidfdOpen(pid) : -1;
+
+            Escalation result = Escalate(
+                    {pid}, graceSeconds,
+                    [&](pid_t, int sig) { return pidfd != -1 ? PidfdSendSignal(pidfd, sig) : SendSignal(pid, sig); },
+                    [&](const std::vector<pid_t> &pids, double seconds) {
+                        return WaitForProcess(pid, pidfd, seconds) ? std::vector<pid_t>() : pids;
+                    });
+
+            if (pidfd != -1)
+                close(pidfd);
+
+            if (!result.failed.empty())
+                return could_not_kill;
+
+            char out[96];
+            if (result.alreadyDead > 0)
+                snprintf(out, sizeof(out), "%ld was already dead", (long) pid);
+            else if (!result.exiting.empty())
+                snprintf(out, sizeof(out), "%ld is still exiting %.3fs after SIGTERM", (long) pid, result.seconds);
+            else if (!result.killed.empty())
+                snprintf(out, sizeof(out), "killed %ld, gone %.3fs after SIGTERM", (long) pid, result.seconds);
+            else if (result.errorCode == no_error)
+                snprintf(out, sizeof(out), "terminated %ld", (long) pid);
+            else
+                return result.errorCode;
+            std::cout << out << std::endl;
+
+            return result.errorCode;
+        }
+
+        /**
+         * SIGTERM to every job's process group in one pass, one shared deadline
+         * for all of them to exit, then SIGKILL for whatever is left
+         */
+        ErrorCode KillAllPIDs(double graceSeconds) {
+            std::vector<pid_t> targets;
+            std::cout << "Murdering " << jobs.Running() << " processes: ";
+            for (const Job &job : jobs) {
+                if (job.state != job_running)
+                    continue;
+                std::cout << job.pid << " ";
+                targets.push_back(job.pid);
+            }
+            std::cout << std::endl;
+
+            Escalation result = Escalate(
+                    targets, graceSeconds,
+                    [&](pid_t pid, int sig) {
+                        // The leader is not reaped yet, so its group cannot have been reused
+                        return killpg(jobs.Find(pid)->pgid, sig) == 0 ? 0 : SendSignal(pid, sig);
+                    },
+                    [&](const std::vector<pid_t> &pids, double seconds) { return WaitForJobs(pids, seconds); });
+
+            printf("terminated %zu, killed %zu after %.1fs grace, in %.3fs",
+                   targets.size() - result.killed.size() - result.failed.size(), result.killed.size(), graceSeconds,
+                   result.seconds);
+            if (!result.exiting.empty())
+                printf(", %zu still exiting", result.exiting.size());
+            if (!result.failed.empty())
+                printf(", %zu could not be signalled", result.failed.size());
+            printf("\n");
+            fflush(stdout);
+
+            return result.errorCode;
+        }
+
+        /**
+         * The wait builtin. The jobs are waited on together through WaitForJobs,
+         * and the ones that finished are reported here instead of as notices.
+         */
+        ErrorCode WaitCommand(const std::vector<pid_t> &pids, bool any, double timeoutSeconds) {
+            ReapBackgroundPIDs();
+
+            std::vector<pid_t> targets;
+            if (pids.empty()) {
+                for (const Job &job : jobs)
+                    targets.push_back(job.pid);
+            }
+            for (pid_t pid : pids) {
+                // Any stage of a pipeline stands for its whole job
+                Job *job = jobs.Find(pid);
+                if (job == nullptr) {
+                    std::cerr << "wait: " << pid << ": not a job of this shell" << std::endl;
+                    mysh->lastStatus = 1;
+                    return no_error;
+                }
+                if (std::find(targets.begin(), targets.end(), job->pid) == targets.end())
+                    targets.push_back(job->pid);
+            }
+            if (targets.empty())
+                return no_error;
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<pid_t> running = WaitForJobs(targets, timeoutSeconds, any);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            long succeeded = 0, failed = 0, signaled = 0;
+            Job *slowest = nullptr;
+            for (pid_t pid : targets) {
+                Job *job = jobs.Find(pid);
+                if (job == nullptr || job->state == job_running)
+                    continue;
+                if (WIFSIGNALED(job->waitStatus))
+                    signaled++;
+                else if (WIFEXITED(job->waitStatus) && WEXITSTATUS(job->waitStatus) == 0)
+                    succeeded++;
+                else
+                    failed++;
+                if (slowest == nullptr || job->endTime - job->startTime > slowest->endTime - slowest->startTime)
+                    slowest = job;
+            }
+
+            printf("wait: %ld exited 0, %ld failed, %ld killed by a signal in %.3fs", succeeded, failed, signaled,
+                   seconds);
+            if (!running.empty())
+                printf(", %zu still running", running.size());
+            printf("\n");
+            if (slowest != nullptr) {
+                printf("slowest: [%ld] %.3fs (%s) %s\n", (long) slowest->pid,
+                       std::chrono::duration<double>(slowest->endTime - slowest->startTime).count(),
+                       DescribeWaitStatus(slowest->waitStatus).c_str(), slowest->commandLine.c_str());
+            }
+            fflush(stdout);
+
+            for (pid_t pid : targets) {
+                if (!IsRunningJob(pid))
+                    jobs.Remove(pid);
+            }
+
+            bool finished = any ? running.size() < targets.size() : running.empty();
+            mysh->lastStatus = finished && failed == 0 && signaled == 0 ? 0 : 1;
+            return no_error;
+        }
+
+        /**
+         * Runs the event loop until every job in pids has been reaped, or until
+         * timeoutSeconds passed (negative waits forever), or with any until the
+         * first of them has. A single timerfd holds the deadline for all of
+         * them. Returns the pids still running.
+         */
+        std::vector<pid_t> WaitForJobs(const std::vector<pid_t> &pids, double timeoutSeconds, bool any = false) {
+            bool expired = false;
+            auto start = std::chrono::steady_clock::now();
+            int timerFd = StartDeadline(timeoutSeconds, expired);
+
+            std::vector<pid_t> running;
+            while (true) {
+                // Jobs without a pidfd or signalfd are only found by polling
+                ReapExitedChildren();
+
+                running.clear();
+                for (pid_t pid : pids) {
+                    if (IsRunningJob(pid))
+                        running.push_back(pid);
+                }
+
+                if (running.empty() || expired || (any && running.size() < pids.size()))
+                    break;
+
+                mysh->eventLoop->RunOnce(DeadlineTimeout(timerFd, timeoutSeconds, start, expired, -1));
+            }
+
+            StopDeadline(timerFd);
+            return running;
+        }
+
+        /**
+         * Runs the event loop until pid exits or timeoutSeconds pass, and says
+         * whether it did. A process of ours is seen reaped in the job table,
+         * anyone else's through pidfd, or by polling kill() without one.
+         */
+        bool WaitForProcess(pid_t pid, int pidfd, double timeoutSeconds) {
+            bool ours = jobs.Find(pid) != nullptr;
+            bool exited = false, expired = false;
+            auto start = std::chrono::steady_clock::now();
+            int timerFd = StartDeadline(timeoutSeconds, expired);
+            if (pidfd != -1)
+                mysh->eventLoop->Add(pidfd, EPOLLIN, [&exited](uint32_t) { exited = true; });
+
+            while (true) {
+                if (ours) {
+                    ReapExitedChildren();
+                    exited = jobs.Find(pid) == nullptr || IsReapedProcess(pid);
+                } else if (pidfd == -1) {
+                    exited = kill(pid, 0) == -1 && errno == ESRCH;
+                }
+                if (exited || expired)
+                    break;
+                mysh->eventLoop->RunOnce(
+                        DeadlineTimeout(timerFd, timeoutSeconds, start, expired, ours || pidfd != -1 ? -1 : 10));
+            }
+
+            if (pidfd != -1)
+                mysh->eventLoop->Remove(pidfd);
+            StopDeadline(timerFd);
+            return exited;
+        }
+
+        // A timerfd on the event loop that sets expired after seconds, -1 if negative or if it cannot be armed
+        int StartDeadline(double seconds, bool &expired) {
+            if (seconds < 0)
+                return -1;
+            int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (timerFd == -1) {
+                perror("timerfd_create");
+                return -1;
+            }
+            struct itimerspec deadline{};
+            // A zero it_value would disarm the timer
+            deadline.it_value.tv_sec = (time_t) seconds;
+            deadline.it_value.tv_nsec = (long) ((seconds - (double) (time_t) seconds) * 1e9) + 1;
+            if (timerfd_settime(timerFd, 0, &deadline, nullptr) == -1 ||
+                !mysh->eventLoop->Add(timerFd, EPOLLIN, [&expired](uint32_t) { expired = true; })) {
+                perror("timerfd_settime");
+                close(timerFd);
+                return -1;
+            }
+            return timerFd;
+        }
+
+        /**
+         * The RunOnce timeout for a wait that would otherwise use timeoutMs. A
+         * deadline StartDeadline could not arm is kept by this timeout instead,
+         * counted from start, and sets expired once it has passed.
+         */
+        static int DeadlineTimeout(int timerFd, double seconds, std::chrono::steady_clock::time_point start,
+                                   bool &expired, int timeoutMs) {
+            if (timerFd != -1 || seconds < 0)
+                return timeoutMs;
+            double left = seconds - std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (left <= 0) {
+                expired = true;
+                return 0;
+            }
+            int ms = (int) std::min(left * 1e3 + 1, (double) INT_MAX);
+            return timeoutMs < 0 ? ms : std::min(ms, timeoutMs);
+        }
+
+        void StopDeadline(int timerFd) {
+            if (timerFd == -1)
+                return;
+            mysh->eventLoop->Remove(timerFd);
+            close(timerFd);
+        }
+
+        /**
+         * Starts the next copy for repeat. One that cannot be started counts as
+         * failed and cuts n down to the copies started so far, since the next
+         * one would not start either.
+         */
+        pid_t LaunchCopy(char **arguments, const LaunchOptions &options, long launched, long &n, long &failed) {
+            pid_t pid = Launch(arguments, options);
+            if (pid < 0) {
+                failed++;
+                n = launched;
+            }
+            return pid;
+        }
+
+        /**
+         * Runs n copies with at most maxInFlight alive at once, starting the
+         * next one as each finishes, and reports the totals
+         */
+        ErrorCode RepeatCommand(char **arguments, LaunchOptions options, long n, long maxInFlight,
+                                bool spread = false) {
+            options.newProcessGroup = true;
+
+            // Each replica takes a CPU of --cpus, or of the shell's own set, no other
+            // running replica has, and hands it back when it is reaped
+            std::deque<int> freeCpus;
+            if (spread) {
+                cpu_set_t allowed = options.cpus;
+                if (!options.pinCpus && sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+                    CPU_ZERO(&allowed);
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &allowed))
+                        freeCpus.push_back(cpu);
+                }
+                options.pinCpus = !freeCpus.empty();
+                if (!freeCpus.empty())
+                    maxInFlight = std::min(maxInFlight, (long) freeCpus.size());
+            }
+
+            // The CPU each running replica holds, -1 when not spread
+            std::unordered_map<pid_t, int> inFlight;
+            long launched = 0, succeeded = 0, failed = 0;
+            auto start = std::chrono::steady_clock::now();
+
+            while (launched < n || !inFlight.empty()) {
+                while (launched < n && (long) inFlight.size() < maxInFlight) {
+                    int cpu = -1;
+                    if (options.pinCpus && !freeCpus.empty()) {
+                        cpu = freeCpus.front();
+                        CPU_ZERO(&options.cpus);
+                        CPU_SET(cpu, &options.cpus);
+                    }
+                    pid_t pid = LaunchCopy(arguments, options, launched, n, failed);
+                    if (pid < 0)
+                        break;
+                    if (cpu != -1)
+                        freeCpus.pop_front();
+                    inFlight[pid] = cpu;
+                    launched++;
+                }
+
+                if (inFlight.empty())
+                    break;
+
+                int wait_status;
+                pid_t pid = WaitChild(-1, &wait_status, 0);
+                if (pid == -1) {
+                    perror("waitpid");
+                    return child_process_error;
+                }
+
+                // Some background job finished meanwhile
+                auto replica = inFlight.find(pid);
+                if (replica == inFlight.end()) {
+                    OnChildExit(pid, wait_status);
+                    continue;
+                }
+                if (replica->second != -1)
+                    freeCpus.push_back(replica->second);
+                inFlight.erase(replica);
+
+                if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)
+                    succeeded++;
+                else
+                    failed++;
+            }
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            printf("repeat: %ld jobs, %ld succeeded, %ld failed in %.3fs (%.1f jobs/sec)\n",
+                   launched, succeeded, failed, seconds, seconds > 0 ? launched / seconds : 0.0);
+
+            mysh->lastStatus = failed > 0 ? 1 : 0;
+            return no_error;
+        }
+
+        /**
+         * repeat --rate: starts copies off a periodic timerfd at a fixed
+         * open-loop rate, whether or not the earlier ones finished, until n
+         * were started or the duration is up. The shell's SIGCHLD handler
+         * reaps them. Latency is measured from when each copy was due rather
+         * than when it started, so copies held back by maxInFlight or a late
+         * wakeup are not left out of the percentiles (coordinated omission).
+         */
+        ErrorCode PacedRepeat(char **arguments, LaunchOptions options, long n, double durationSeconds, double rate,
+                              long maxInFlight) {
+            options.newProcessGroup = true;
+            if (durationSeconds >= 0)
+                n = std::min(n, (long) (durationSeconds * rate + 1e-9));
+
+            auto start = std::chrono::steady_clock::now();
+            auto DueAt = [start, rate](long i) {
+                return start + std::chrono::nanoseconds((long long) ((double) i * 1e9 / rate));
+            };
+
+            int pacer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            int progress = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (pacer == -1 || progress == -1) {
+                perror("timerfd_create");
+                for (int fd : {pacer, progress}) {
+                    if (fd != -1)
+                        close(fd);
+                }
+                return child_process_error;
+            }
+
+            struct itimerspec schedule{};
+            long long period = std::max(1LL, (long long) (1e9 / rate));
+            schedule.it_interval.tv_sec = period / 1000000000;
+            schedule.it_interval.tv_nsec = period % 1000000000;
+            // The first copy is due right away, a zero it_value would disarm the timer
+            schedule.it_value.tv_nsec = 1;
+            timerfd_settime(pacer, 0, &schedule, nullptr);
+            struct itimerspec second{};
+            second.it_interval.tv_sec = 1;
+            second.it_value.tv_sec = 1;
+            timerfd_settime(progress, 0, &second, nullptr);
+
+            PacedRun run;
+            long due = 0, launched = 0, peakInFlight = 0, lastLaunched = 0;
+            bool reportProgress = false;
+            auto lastLaunch = start;
+
+            mysh->eventLoop->Add(pacer, EPOLLIN, [pacer, n, &due](uint32_t) {
+                uint64_t expirations;
+                if (read(pacer, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    due = std::min(n, due + (long) expirations);
+            });
+            mysh->eventLoop->Add(progress, EPOLLIN, [progress, &reportProgress](uint32_t) {
+                uint64_t expirations;
+                if (read(progress, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    reportProgress = true;
+            });
+
+            while (launched < n || !run.inFlight.empty()) {
+                mysh->eventLoop->RunOnce(-1);
+                PollWatchedChildren();
+
+                while (launched < due && (long) run.inFlight.size() < maxInFlight) {
+                    auto started = std::chrono::steady_clock::now();
+                    pid_t pid = LaunchCopy(arguments, options, launched, n, run.failed);
+                    if (pid < 0) {
+                        due = n;
+                        break;
+                    }
+                    run.inFlight[pid] = {DueAt(launched), started};
+                    WatchChild(pid, [&run, pid](int wait_status) { run.Finished(pid, wait_status); });
+                    lastLaunch = started;
+                    launched++;
+                    peakInFlight = std::max(peakInFlight, (long) run.inFlight.size());
+                }
+
+                if (launched == n && pacer != -1) {
+                    mysh->eventLoop->Remove(pacer);
+                    close(pacer);
+                    pacer = -1;
+                }
+
+                if (reportProgress) {
+                    reportProgress = false;
+                    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    fprintf(stderr, "repeat: %5.1fs  started %ld (%ld/s)  in flight %zu  done %ld  failed %ld"
+                                    "  p50 %.2fms  p99 %.2fms\n",
+                            elapsed, launched, launched - lastLaunched, run.inFlight.size(),
+                            run.succeeded + run.failed, run.failed,
+                            (double) run.latency.Percentile(50) / 1000.0, (double) run.latency.Percentile(99) / 1000.0);
+                    lastLaunched = launched;
+                }
+            }
+
+            if (pacer != -1) {
+                mysh->eventLoop->Remove(pacer);
+                close(pacer);
+            }
+            mysh->eventLoop->Remove(progress);
+            close(progress);
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            // Over the span copies were being started, one period included for the last one
+            double launchSeconds = std::chrono::duration<double>(lastLaunch - start).count() + 1.0 / rate;
+            printf("repeat: %ld jobs, %ld succeeded, %ld failed in %.3fs\n",
+                   launched, run.succeeded, run.failed, seconds);
+            printf("rate: %.1f/s target, %.1f/s achieved, peak %ld in flight\n",
+                   rate, launched > 0 ? (double) launched / launchSeconds : 0.0, peakInFlight);
+            for (auto [name, histogram] : {std::make_pair("latency", &run.latency),
+                                           std::make_pair("service", &run.service)}) {
+                printf("%-8s p50 %.2fms  p90 %.2fms  p99 %.2fms  p99.9 %.2fms  max %.2fms\n", name,
+                       (double) histogram->Percentile(50) / 1000.0, (double) histogram->Percentile(90) / 1000.0,
+                       (double) histogram->Percentile(99) / 1000.0, (double) histogram->Percentile(99.9) / 1000.0,
+                       (double) histogram->Max() / 1000.0);
+            }
+
+            mysh->lastStatus = run.failed > 0 ? 1 : 0;
+            return no_error;
+        }
+
+        // "200/s", "1500/m", "10/h" or a bare number per second
+        static bool ParseRate(std::string_view text, double &perSecond) {
+            auto result = std::from_chars(text.data(), text.data() + text.size(), perSecond);
+            if (result.ec != std::errc() || !(perSecond > 0))
+                return false;
+
+            std::string_view unit(result.ptr, text.data() + text.size() - result.ptr);
+            if (unit.empty() || unit == "/s")
+                return true;
+            if (unit == "/m")
+                perSecond /= 60;
+            else if (unit == "/h")
+                perSecond /= 3600;
+            else
+                return false;
+            return true;
+        }
+
+        /**
+         * run, but keyed on everything the result should depend on: argv, the
+         * directory, the MYSH_CACHE_ENV variables (PATH, LANG, LC_ALL and TZ
+         * by default), and path, size and mtime of the program and of every
+         * argument or < input that names a file. Output redirects and
+         * pipelines are run as usual, uncached.
+         */
+        ErrorCode RunCached(std::vector<std::string_view> &inputParameters) {
+            if (HasPipe(inputParameters) || !OnlyInputRedirected(inputParameters))
+                return mysh->ExecuteCommand(mysh->commands.Find("run"), inputParameters);
+
+            LaunchOptions options;
+            if (!ParseResourceOptions(inputParameters, options)) {
+                mysh->lastStatus = 1;
+                return no_error;
+            }
+
+            std::string key = inputParameters.empty() ? std::string() : CacheKey(inputParameters);
+            if (!ParseRedirections(inputParameters, options) || inputParameters.empty()) {
+                CloseRedirections(options);
+                mysh->lastStatus = 1;
+                return inputParameters.empty() ? incorrect_parameters : no_error;
+            }
+
+            ResultCache::Result result;
+            auto start = std::chrono::steady_clock::now();
+
+            if (resultCache.Lookup(key, result)) {
+                CloseRedirections(options);
+                FlushOutput();
+                WriteAll(STDOUT_FILENO, result.out.data(), result.out.size());
+                WriteAll(STDERR_FILENO, result.err.data(), result.err.size());
+                mysh->lastStatus = result.status;
+
+                double replay = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                resultCache.RecordHit(std::max(0.0, result.runSeconds - replay));
+                return no_error;
             }
 
-        private:
-            ProcessHandler *processHandler;
-        };
+            char **arguments = InputParametersToCharArguments(inputParameters);
+            int wait_status;
+            bool complete = RunCaptured(arguments, options, result, &wait_status);
+            FreeCharArguments(arguments);
+            CloseRedirections(options);
 
-        class ExterminatePID : public Command {
-        public:
-            explicit ExterminatePID(Mysh *mysh, ProcessHandler *ph) {
-                this->mysh = mysh;
-                this->processHandler = ph;
-                this->keyword = "exterminate";
-                this->validParameters = {};
-                this->allowCustomParameters = true;
+            if (wait_status == -1) {
+                mysh->lastStatus = 127;
+                return no_error;
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                if (inputParameters.empty())
-                    return incorrect_parameters;
+            result.status = ExitStatusOf(wait_status);
+            result.runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            mysh->lastStatus = result.status;
+            resultCache.RecordMiss();
 
-                pid_t pid;
-                try {
-                    pid = (pid_t) std::stoi(inputParameters[0]);
-                } catch (std::exception &err) {
-                    return incorrect_parameters;
-                }
+            // A killed run says nothing about the command's real result
+            if (complete && WIFEXITED(wait_status))
+                resultCache.Store(key, result);
+            return no_error;
+        }
 
-                ErrorCode ec = Mysh::ProcessHandler::KillPID(pid);
+        static bool OnlyInputRedirected(const std::vector<std::string_view> &parameters) {
+            for (auto parameter : parameters) {
+                if (Tokenizer::IsOperator(parameter) && !Tokenizer::IsOperator(parameter, Tokenizer::INPUT))
+                    return false;
+            }
+            return true;
+        }
 
-                if (ec == no_error) {
-                    if (processHandler->RemoveBackgroundPID(pid))
-                        std::cout << "successfully killed " << pid << std::endl;
-                    else {
-                        std::cout << pid << " was already dead" << std::endl;
-                    }
-                }
+        std::string CacheKey(const std::vector<std::string_view> &parameters) {
+            std::string key = "argv";
+            for (auto parameter : parameters) {
+                key += '\0';
+                key += parameter;
+            }
 
-                return ec;
+            char *cwd = getcwd(nullptr, 0);
+            key += "\ncwd ";
+            key += cwd != nullptr ? cwd : "";
+            free(cwd);
+
+            const char *names = getenv("MYSH_CACHE_ENV");
+            std::string_view list = names != nullptr ? names : "PATH,LANG,LC_ALL,TZ";
+            while (!list.empty()) {
+                size_t comma = list.find(',');
+                std::string name(list.substr(0, comma));
+                list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+                const char *value = getenv(name.c_str());
+                key += "\nenv " + name + (value != nullptr ? "=" + std::string(value) : "");
             }
 
-        private:
-            ProcessHandler *processHandler;
-        };
+            auto addFile = [&key](const std::string &path) {
+                struct stat st{};
+                if (stat(path.c_str(), &st) != 0)
+                    return;
+                char line[96];
+                snprintf(line, sizeof(line), " %lld %lld.%09ld", (long long) st.st_size,
+                         (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+                key += "\nfile " + path + line;
+            };
+
+            // A new build of the program invalidates its results too
+            std::string program(parameters[0]);
+            addFile(program.find('/') == std::string::npos ? pathCache.Resolve(program) : program);
+            for (size_t i = 1; i < parameters.size(); i++) {
+                if (!Tokenizer::IsOperator(parameters[i]))
+                    addFile(std::string(parameters[i]));
+            }
+            return key;
+        }
 
         /**
-         * Extra Credit: Murder all background processes
+         * Runs the program with stdout and stderr on pipes, passing output
+         * through as it comes and keeping a copy in result. Returns false if
+         * the output outgrew what the cache stores.
          */
-        class ExterminateAll : public Command {
-        public:
-            explicit ExterminateAll(Mysh *mysh, ProcessHandler *ph) {
-                this->mysh = mysh;
-                this->processHandler = ph;
-                this->keyword = "exterminateall";
-                this->validParameters = {};
-                this->allowCustomParameters = false;
+        bool RunCaptured(char **arguments, LaunchOptions options, ResultCache::Result &result, int *wait_status) {
+            *wait_status = -1;
+            int outPipe[2], errPipe[2];
+            if (pipe2(outPipe, O_CLOEXEC) == -1)
+                return false;
+            if (pipe2(errPipe, O_CLOEXEC) == -1) {
+                close(outPipe[0]);
+                close(outPipe[1]);
+                return false;
             }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                return processHandler->KillAllPIDs();
+            options.redirects.insert(options.redirects.begin(),
+                                     {{outPipe[1], STDOUT_FILENO}, {errPipe[1], STDERR_FILENO}});
+            pid_t pid = Launch(arguments, options);
+            close(outPipe[1]);
+            close(errPipe[1]);
+
+            bool complete = true;
+            size_t limit = resultCache.MaxEntryBytes();
+            EventLoop loop;
+            int fds[2] = {outPipe[0], errPipe[0]};
+            std::string *buffers[2] = {&result.out, &result.err};
+            for (int i = 0; i < 2 && pid > 0; i++) {
+                int *fd = &fds[i];
+                std::string *buffer = buffers[i];
+                int echo = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+                fcntl(*fd, F_SETFL, O_NONBLOCK);
+                loop.Add(*fd, EPOLLIN, [&loop, &complete, &result, fd, buffer, echo, limit](uint32_t) {
+                    char chunk[65536];
+                    ssize_t n;
+                    while ((n = read(*fd, chunk, sizeof(chunk))) > 0) {
+                        WriteAll(echo, chunk, n);
+                        if (result.out.size() + result.err.size() + n > limit)
+                            complete = false;
+                        else
+                            buffer->append(chunk, n);
+                    }
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                        loop.Remove(*fd);
+                        close(*fd);
+                        *fd = -1;
+                    }
+                });
             }
 
-        private:
-            ProcessHandler *processHandler;
+            while (pid > 0 && (fds[0] != -1 || fds[1] != -1))
+                loop.RunOnce(-1);
+
+            for (int fd : fds) {
+                if (fd != -1)
+                    close(fd);
+            }
+
+            if (pid > 0)
+                WaitChild(pid, wait_status, 0);
+            return complete;
+        }
+
+        struct ParallelJob {
+            size_t index;
+            pid_t pid;
+            int outFd;
+            int errFd;
+            std::string out;
+            std::string err;
+            int wait_status;
+            bool exited;
         };
 
         /**
-         * Extra Credit: Repeat command N times
+         * Keeps up to maxInFlight jobs running, one per item. Each job writes
+         * into its own pipes, drained on the shell's event loop. A job's slot
+         * frees up as soon as it is reaped through WatchChild; its output is
+         * written in one piece once it exited and both pipes closed.
          */
-        class Repeat : public Command {
-        public:
-            explicit Repeat(Mysh *mysh, ProcessHandler *ph) {
-                this->mysh = mysh;
-                this->processHandler = ph;
-                this->keyword = "repeat";
-                this->validParameters = {};
-                this->allowCustomParameters = true;
-            }
+        ErrorCode ParallelCommand(const std::vector<std::string_view> &command, const std::vector<std::string> &items,
+                                  LaunchOptions options, long maxInFlight, bool keepOrder) {
+            options.newProcessGroup = true;
+
+            // Our pipes come first so the user's own redirects still win
+            int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            std::vector<FdRedirect> userRedirects = options.redirects;
+
+            bool substitutes = std::any_of(command.begin(), command.end(), [](std::string_view parameter) {
+                return parameter.find("{}") != std::string_view::npos;
+            });
+
+            EventLoop &loop = *mysh->eventLoop;
+            std::unordered_map<pid_t, ParallelJob> running;
+            std::unordered_map<size_t, ParallelJob> held;
+            long alive = 0;
+            size_t next = 0, printed = 0;
+            long succeeded = 0, failed = 0;
+            auto start = std::chrono::steady_clock::now();
+
+            auto drain = [&loop](int &fd, std::string &buffer) {
+                char chunk[16384];
+                ssize_t n;
+                while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+                    buffer.append(chunk, n);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    loop.Remove(fd);
+                    close(fd);
+                    fd = -1;
+                }
+            };
+
+            auto report = [&](ParallelJob &job) {
+                FlushOutput();
+                WriteAll(STDOUT_FILENO, job.out.data(), job.out.size());
+                WriteAll(STDERR_FILENO, job.err.data(), job.err.size());
+                if (!WIFEXITED(job.wait_status) || WEXITSTATUS(job.wait_status) != 0)
+                    std::cerr << "parallel: " << items[job.index] << ": "
+                              << DescribeWaitStatus(job.wait_status) << std::endl;
+            };
+
+            while (next < items.size() || !running.empty()) {
+                while (next < items.size() && alive < maxInFlight) {
+                    int outPipe[2], errPipe[2];
+                    if (pipe2(outPipe, O_CLOEXEC) == -1) {
+                        perror("pipe");
+                        break;
+                    }
+                    if (pipe2(errPipe, O_CLOEXEC) == -1) {
+                        perror("pipe");
+                        close(outPipe[0]);
+                        close(outPipe[1]);
+                        break;
+                    }
 
-            ErrorCode Execute(std::vector<std::string> &inputParameters) override {
-                ErrorCode errorCode = no_error;
+                    options.redirects = {{devNull, STDIN_FILENO}, {outPipe[1], STDOUT_FILENO},
+                                         {errPipe[1], STDERR_FILENO}};
+                    options.redirects.insert(options.redirects.end(), userRedirects.begin(), userRedirects.end());
+
+                    std::vector<std::string> expanded = ExpandItem(command, items[next], substitutes);
+                    std::vector<std::string_view> parameters(expanded.begin(), expanded.end());
+                    char **arguments = InputParametersToCharArguments(parameters);
+                    pid_t pid = Launch(arguments, options);
+                    FreeCharArguments(arguments);
+                    close(outPipe[1]);
+                    close(errPipe[1]);
+
+                    if (pid < 0) {
+                        // It will not start for the next item either
+                        close(outPipe[0]);
+                        close(errPipe[0]);
+                        failed += (long) (items.size() - next);
+                        next = items.size();
+                        break;
+                    }
 
-                int n;
-                try {
-                    n = (int) std::stoi(inputParameters[0]);
-                } catch (std::exception &err) {
-                    return incorrect_parameters;
+                    ParallelJob &job = running[pid] = {next++, pid, outPipe[0], errPipe[0], {}, {}, 0, false};
+                    alive++;
+                    WatchChild(pid, [&running, &alive, pid](int wait_status) {
+                        ParallelJob &owner = running[pid];
+                        owner.wait_status = wait_status;
+                        owner.exited = true;
+                        alive--;
+                    });
+                    fcntl(job.outFd, F_SETFL, O_NONBLOCK);
+                    fcntl(job.errFd, F_SETFL, O_NONBLOCK);
+                    loop.Add(job.outFd, EPOLLIN, [&running, &drain, pid](uint32_t) {
+                        ParallelJob &owner = running[pid];
+                        drain(owner.outFd, owner.out);
+                    });
+                    loop.Add(job.errFd, EPOLLIN, [&running, &drain, pid](uint32_t) {
+                        ParallelJob &owner = running[pid];
+                        drain(owner.errFd, owner.err);
+                    });
                 }
 
-                inputParameters.erase(inputParameters.begin());
-                char **arguments = InputParametersToCharArguments(inputParameters);
-                errorCode = processHandler->RepeatCommand(arguments, n);
+                // Out of pipes with nothing running to give some back, the rest cannot start
+                if (running.empty()) {
+                    failed += (long) (items.size() - next);
+                    break;
+                }
 
-                return errorCode;
-            }
+                loop.RunOnce(-1);
+                PollWatchedChildren();
 
-        private:
-            ProcessHandler *processHandler;
-        };
+                for (auto it = running.begin(); it != running.end();) {
+                    ParallelJob &job = it->second;
+                    if (!job.exited || job.outFd != -1 || job.errFd != -1) {
+                        ++it;
+                        continue;
+                    }
 
-    public:
-        explicit ProcessHandler(Mysh *mysh) {
-            this->mysh = mysh;
+                    if (WIFEXITED(job.wait_status) && WEXITSTATUS(job.wait_status) == 0)
+                        succeeded++;
+                    else
+                        failed++;
 
-            mysh->commands->push_back(new RunForeground(mysh, this));
-            mysh->commands->push_back(new RunBackground(mysh, this));
-            mysh->commands->push_back(new ExterminatePID(mysh, this));
-            mysh->commands->push_back(new ExterminateAll(mysh, this));
-            mysh->commands->push_back(new Repeat(mysh, this));
-        }
+                    if (!keepOrder)
+                        report(job);
+                    else
+                        held.emplace(job.index, std::move(job));
+                    it = running.erase(it);
+                }
 
-        int CountRunningProcesses() {
-            return backgroundPIDs.size();
-        }
+                // In order, a finished job waits for every earlier one
+                for (auto it = held.find(printed); it != held.end(); it = held.find(++printed)) {
+                    report(it->second);
+                    held.erase(it);
+                }
+            }
 
-    private:
-        Mysh *mysh;
-        std::vector<pid_t> backgroundPIDs;
+            // Items that never started leave gaps, print what is still held
+            for (size_t index = printed; !held.empty() && index < items.size(); index++) {
+                auto it = held.find(index);
+                if (it != held.end()) {
+                    report(it->second);
+                    held.erase(it);
+                }
+            }
 
-        static ErrorCode ForkExecWait(char **arguments) {
-            pid_t c_pid, w;
-            int wait_status;
+            if (devNull != -1)
+                close(devNull);
 
-            c_pid = fork();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            long jobs = succeeded + failed;
+            fprintf(stderr, "parallel: %ld jobs, %ld succeeded, %ld failed in %.3fs (%.1f jobs/sec)\n",
+                    jobs, succeeded, failed, seconds, seconds > 0 ? jobs / seconds : 0.0);
 
-            if (c_pid < 0) {
-                perror("forking failed\n");
-                exit(EXIT_FAILURE);
+            mysh->lastStatus = failed > 0 ? 1 : 0;
+            return no_error;
+        }
+
+        // Replaces every {} with the item, or appends it when the command has none
+        static std::vector<std::string> ExpandItem(const std::vector<std::string_view> &command,
+                                                   const std::string &item, bool substitutes) {
+            std::vector<std::string> expanded;
+            expanded.reserve(command.size() + 1);
+            for (auto parameter : command) {
+                std::string &argument = expanded.emplace_back();
+                size_t from = 0, at;
+                while ((at = parameter.find("{}", from)) != std::string_view::npos) {
+                    argument.append(parameter, from, at - from);
+                    argument += item;
+                    from = at + 2;
+                }
+                argument.append(parameter, from, std::string_view::npos);
             }
+            if (!substitutes)
+                expanded.push_back(item);
+            return expanded;
+        }
 
-            if (c_pid == 0) {
-                int execError = execvp(arguments[0], arguments);
+        static std::string JoinParameters(const std::vector<std::string_view> &inputParameters) {
+            std::string line;
+            for (auto parameter : inputParameters) {
+                if (!line.empty())
+                    line += ' ';
+                line += parameter;
+            }
+            return line;
+        }
 
-                if (execError == -1) {
-                    std::cerr << "could not execute " << arguments[0] << std::endl;
-                    exit(1);
-                }
-            } else {
-                w = waitpid(c_pid, &wait_status, 0);
+        static char **InputParametersToCharArguments(std::vector<std::string_view> &inputParameters) {
+            char **arguments = nullptr;
+            int iPLen = inputParameters.size();
 
-                if (w == -1) {
-                    perror("waitpid");
-                    return child_process_error;
-                }
+            arguments = new char *[iPLen + 1];
+            for (auto i = 0; i < iPLen; i++) {
+                arguments[i] = strndup(inputParameters[i].data(), inputParameters[i].size());
             }
+            arguments[iPLen] = nullptr;
 
-            return no_error;
+            return arguments;
         }
 
-        static ErrorCode ForkExecBackground(char **arguments, pid_t *pid) {
-            pid_t c_pid;
+        static void FreeCharArguments(char **arguments) {
+            for (char **argument = arguments; *argument != nullptr; argument++)
+                free(*argument);
+            delete[] arguments;
+        }
+    };
 
-            c_pid = fork();
+    /**
+     * mysh --serve: one long-lived shell answering many clients on a Unix
+     * socket. A request is a batch of command lines ended by an empty line or
+     * by the client shutting down its side. Connections are multiplexed on the
+     * shell's own event loop; batches share the job table, spawn engine and
+     * directory, so they run one at a time in arrival order. While a batch
+     * waits for a child the loop keeps reading the others, whose queue_us
+     * then counts that wait. Each command's
+     * stdout and stderr go to memfds and come back as one JSON line
+     *   {"batch":1,"line":"run ls","status":0,"wall_us":950,"out":"...","err":""}
+     * and each batch ends with
+     *   {"batch":1,"done":true,"commands":1,"status":0,"queue_us":12,"wall_us":960,"notices":""}
+     * where notices are the "[pid] done" lines of jobs this client started.
+     * background always captures here, its output is read back with joblog.
+     */
+    class ServerHandler {
+    public:
+        explicit ServerHandler(Mysh *mysh) {
+            this->mysh = mysh;
+        }
 
-            if (c_pid < 0) {
-                perror("forking failed\n");
-                exit(EXIT_FAILURE);
+        ~ServerHandler() {
+            for (auto &[fd, client] : clients) {
+                mysh->eventLoop->Remove(fd);
+                close(fd);
             }
+            if (listenFd != -1) {
+                mysh->eventLoop->Remove(listenFd);
+                close(listenFd);
+                unlink(path.c_str());
+            }
+            if (stopFd != -1) {
+                mysh->eventLoop->Remove(stopFd);
+                close(stopFd);
+            }
+            for (int fd : {savedOut, savedErr}) {
+                if (fd != -1)
+                    close(fd);
+            }
+        }
 
-            if (c_pid == 0) {
-                // Set new process group to stop capturing input from caller shell
-                setpgid(0, 0);
-
-                int execError = execvp(arguments[0], arguments);
-
-                if (execError == -1) {
-                    std::cerr << "could not execute " << arguments[0] << std::endl;
-                    exit(1);
+        // Runs until SIGINT or SIGTERM, then removes the socket
+        int Serve(const std::string &socketPath) {
+            struct sockaddr_un address{};
+            if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+                std::cerr << socketPath << ": bad socket path" << std::endl;
+                return 1;
+            }
+            address.sun_family = AF_UNIX;
+            memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+            listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd == -1 || !RemoveStaleSocket(address) ||
+                bind(listenFd, (const struct sockaddr *) &address, sizeof(address)) == -1 ||
+                listen(listenFd, SOMAXCONN) == -1) {
+                perror(socketPath.c_str());
+                return 1;
+            }
+            path = socketPath;
+            mysh->serving = true;
+            mysh->eventLoop->Add(listenFd, EPOLLIN, [this](uint32_t) { Accept(); });
+
+            sigset_t stopSignals;
+            sigemptyset(&stopSignals);
+            sigaddset(&stopSignals, SIGINT);
+            sigaddset(&stopSignals, SIGTERM);
+            sigprocmask(SIG_BLOCK, &stopSignals, nullptr);
+            stopFd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (stopFd != -1)
+                mysh->eventLoop->Add(stopFd, EPOLLIN, [this](uint32_t) { stopping = true; });
+
+            // Commands must not read the terminal or the orchestrator's stdin
+            int devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (devNull != -1) {
+                dup2(devNull, STDIN_FILENO);
+                close(devNull);
+            }
+            savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+            savedErr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+
+            while (!stopping) {
+                // One batch per turn, so accepting and flushing never wait behind a long queue
+                mysh->eventLoop->RunOnce(queue.empty() ? -1 : 0);
+                if (!queue.empty()) {
+                    Batch batch = std::move(queue.front());
+                    queue.pop_front();
+                    RunBatch(batch);
                 }
-            } else {
-                *pid = c_pid;
+                mysh->processHandler->ReapBackgroundPIDs();
             }
-
-            return no_error;
+            return 0;
         }
 
-        static ErrorCode KillPID(pid_t pid) {
-            int kill_err = kill(pid, SIGINT);
-
-            if (kill_err == 0)
-                return no_error;
+        /**
+         * The client side: sends text as requests, copies the JSON lines back
+         * to stdout and returns the status of the last finished batch.
+         */
+        static int Connect(const std::string &socketPath, const std::string &text) {
+            struct sockaddr_un address{};
+            if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+                std::cerr << socketPath << ": bad socket path" << std::endl;
+                return 1;
+            }
+            address.sun_family = AF_UNIX;
+            memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd == -1 || connect(fd, (const struct sockaddr *) &address, sizeof(address)) == -1) {
+                perror(socketPath.c_str());
+                if (fd != -1)
+                    close(fd);
+                return 1;
+            }
 
-            kill_err = kill(pid, SIGTERM);
+            // The server answers while we still send, so a large request must not fill both directions
+            int status = 1;
+            std::string pending;
+            size_t sent = 0;
+            bool writing = true;
+            char chunk[65536];
+            while (true) {
+                struct pollfd fds[1] = {{fd, (short) (POLLIN | (writing ? POLLOUT : 0)), 0}};
+                if (poll(fds, 1, -1) == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    perror("poll");
+                    break;
+                }
+                if (writing && (fds[0].revents & (POLLOUT | POLLERR))) {
+                    ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                    if (n > 0)
+                        sent += n;
+                    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                        perror(socketPath.c_str());
+                        break;
+                    }
+                    if (sent == text.size()) {
+                        shutdown(fd, SHUT_WR);
+                        writing = false;
+                    }
+                }
+                if (fds[0].revents & (POLLIN | POLLHUP)) {
+                    ssize_t n = read(fd, chunk, sizeof(chunk));
+                    if (n <= 0)
+                        break;
+                    if (write(STDOUT_FILENO, chunk, n) != n)
+                        break;
+                    pending.append(chunk, n);
+                    size_t newline;
+                    while ((newline = pending.find('\n')) != std::string::npos) {
+                        std::string_view record(pending.data(), newline);
+                        long value;
+                        size_t field = record.find(",\"status\":");
+                        if (record.find("\"done\":true") != std::string_view::npos && field != std::string_view::npos) {
+                            std::string_view digits = record.substr(field + 10);
+                            digits = digits.substr(0, digits.find(','));
+                            if (ParseNumber(digits, value))
+                                status = (int) value;
+                        }
+                        pending.erase(0, newline + 1);
+                    }
+                }
+            }
+            close(fd);
+            return status;
+        }
 
-            if (kill_err == 0)
-                return no_error;
+    private:
+        // Unread input or unsent output past these drops the client
+        static constexpr size_t MAX_REQUEST = 1 << 20;
+        static constexpr size_t MAX_BACKLOG = 64 << 20;
+        // Per stream and command, the rest is cut and flagged "truncated"
+        static constexpr size_t MAX_OUTPUT = 1 << 20;
+
+        struct Client {
+            uint64_t id;
+            std::string in;
+            std::string out;
+            std::vector<std::string> lines;
+            long batches = 0;
+            long queued = 0;
+            bool readClosed = false;
+        };
 
-            kill_err = kill(pid, SIGKILL);
+        struct Batch {
+            int fd;
+            uint64_t id;
+            long number;
+            std::vector<std::string> lines;
+            std::chrono::steady_clock::time_point received;
+        };
 
-            if (kill_err == 0)
-                return no_error;
+        Mysh *mysh;
+        std::string path;
+        int listenFd = -1;
+        int stopFd = -1;
+        int savedOut = -1;
+        int savedErr = -1;
+        bool stopping = false;
+        // 0 is the shell itself, see Job::owner
+        uint64_t nextId = 1;
+        std::unordered_map<int, Client> clients;
+        std::deque<Batch> queue;
+
+        // A socket file left by a server that is gone is replaced, a live one is not
+        static bool RemoveStaleSocket(const struct sockaddr_un &address) {
+            struct stat st{};
+            if (lstat(address.sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+                return true;
 
-            if (kill_err == -1)
-                return could_not_kill;
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool live = probe != -1 && connect(probe, (const struct sockaddr *) &address, sizeof(address)) == 0;
+            if (probe != -1)
+                close(probe);
+            if (live) {
+                errno = EADDRINUSE;
+                return false;
+            }
+            return unlink(address.sun_path) == 0;
+        }
 
-            return no_error;
+        void Accept() {
+            int fd;
+            while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                // Edge triggered: reads and writes always go on until EAGAIN
+                if (!mysh->eventLoop->Add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                          [this, fd](uint32_t events) { OnClientEvent(fd, events); })) {
+                    close(fd);
+                    continue;
+                }
+                clients[fd].id = nextId++;
+            }
         }
 
-        ErrorCode KillAllPIDs() {
-            ErrorCode errorCode = no_error;
+        void OnClientEvent(int fd, uint32_t events) {
+            auto it = clients.find(fd);
+            if (it == clients.end())
+                return;
+            Client &client = it->second;
+
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                char chunk[65536];
+                ssize_t n;
+                while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+                    client.in.append(chunk, n);
+                if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+                    client.readClosed = true;
+                if (!ParseRequests(fd, client)) {
+                    Drop(fd);
+                    return;
+                }
+            }
+            if (!Flush(fd, client))
+                Drop(fd);
+        }
 
-            std::cout << "Murdering " << backgroundPIDs.size() << " processes: ";
-            for (auto pid : backgroundPIDs) {
-                std::cout << pid << " ";
-                errorCode = KillPID(pid);
+        // Queues every finished batch; false if the client sent more than a request may hold
+        bool ParseRequests(int fd, Client &client) {
+            size_t from = 0, newline;
+            while ((newline = client.in.find('\n', from)) != std::string::npos) {
+                size_t end = newline > from && client.in[newline - 1] == '\r' ? newline - 1 : newline;
+                if (end == from)
+                    Enqueue(fd, client);
+                else
+                    client.lines.emplace_back(client.in, from, end - from);
+                from = newline + 1;
             }
+            client.in.erase(0, from);
 
-            this->ClearBackgroundPIDs();
+            if (client.readClosed) {
+                if (!client.in.empty())
+                    client.lines.push_back(std::move(client.in));
+                client.in.clear();
+                Enqueue(fd, client);
+            }
+            return client.in.size() <= MAX_REQUEST;
+        }
 
-            std::cout << std::endl;
-            return errorCode;
+        void Enqueue(int fd, Client &client) {
+            if (client.lines.empty())
+                return;
+            queue.push_back({fd, client.id, ++client.batches, std::move(client.lines),
+                             std::chrono::steady_clock::now()});
+            client.lines.clear();
+            client.queued++;
         }
 
-        ErrorCode RepeatCommand(char **arguments, int n) {
-            ErrorCode errorCode = no_error;
-            pid_t pid;
-            std::string ret = "PIDs: ";
-            fflush(stdout);
-            for (int i = 0; i < n; i++) {
-                errorCode = ForkExecBackground(arguments, &pid);
-                AddBackgroundPID(pid);
-                ret += std::to_string(pid);
-                ret += ", ";
+        // Sends what the socket takes; false once the client is gone or done
+        bool Flush(int fd, Client &client) {
+            size_t sent = 0;
+            while (sent < client.out.size()) {
+                ssize_t n = send(fd, client.out.data() + sent, client.out.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN)
+                        return false;
+                    break;
+                }
+                sent += n;
             }
-            std::cout << ret << std::endl;
-            return errorCode;
+            client.out.erase(0, sent);
+            if (client.out.size() > MAX_BACKLOG)
+                return false;
+            return !(client.readClosed && client.queued == 0 && client.lines.empty() && client.out.empty());
         }
 
-        void AddBackgroundPID(pid_t pid) {
-            backgroundPIDs.push_back(pid);
+        void Drop(int fd) {
+            // Nobody is left to tell about its finished jobs
+            mysh->processHandler->TakeNotices(clients[fd].id);
+            mysh->eventLoop->Remove(fd);
+            close(fd);
+            clients.erase(fd);
         }
 
-        bool RemoveBackgroundPID(pid_t pid) {
-            for (long unsigned i = 0; i < backgroundPIDs.size(); i++) {
-                if (pid == backgroundPIDs[i]) {
-                    backgroundPIDs.erase(backgroundPIDs.begin() + i);
-                    return true;
+        void RunBatch(Batch &batch) {
+            auto ClientOf = [this, &batch]() -> Client * {
+                auto it = clients.find(batch.fd);
+                return it != clients.end() && it->second.id == batch.id ? &it->second : nullptr;
+            };
+            if (ClientOf() == nullptr)
+                return;
+
+            auto start = std::chrono::steady_clock::now();
+            std::string records, out, err;
+            bool exiting = false;
+            size_t ran = 0;
+            mysh->processHandler->SetJobOwner(batch.id);
+            for (const std::string &line : batch.lines) {
+                auto commandStart = std::chrono::steady_clock::now();
+                ErrorCode ec = no_error;
+                bool truncated = Capture([this, &line, &ec]() {
+                    ec = mysh->ProcessInput(line);
+                    ErrorCodeHandler::HandleErrorCode(ec);
+                }, out, err);
+
+                records += "{\"batch\":" + std::to_string(batch.number) + ",\"line\":";
+                AppendJson(records, line);
+                records += ",\"status\":" + std::to_string(mysh->lastStatus) +
+                           ",\"wall_us\":" + std::to_string(MicrosSince(commandStart)) + ",\"out\":";
+                AppendJson(records, out);
+                records += ",\"err\":";
+                AppendJson(records, err);
+                records += truncated ? ",\"truncated\":true}\n" : "}\n";
+                ran++;
+
+                // byebye ends this client's session, never the server
+                if (ec == request_exit) {
+                    exiting = true;
+                    break;
                 }
             }
 
-            ClearBackgroundPIDs();
-            return false;
+            mysh->processHandler->SetJobOwner(0);
+            records += "{\"batch\":" + std::to_string(batch.number) + ",\"done\":true,\"commands\":" +
+                       std::to_string(ran) + ",\"status\":" + std::to_string(mysh->lastStatus) +
+                       ",\"queue_us\":" + std::to_string(
+                    std::chrono::duration_cast<std::chrono::microseconds>(start - batch.received).count()) +
+                       ",\"wall_us\":" + std::to_string(MicrosSince(start)) + ",\"notices\":";
+            AppendJson(records, mysh->processHandler->TakeNotices(batch.id));
+            records += "}\n";
+
+            // Commands may have run the event loop, and with it this client's handlers
+            Client *client = ClientOf();
+            if (client == nullptr)
+                return;
+            client->queued--;
+            client->out += records;
+            if (exiting) {
+                client->readClosed = true;
+                client->lines.clear();
+                client->in.clear();
+                queue.erase(std::remove_if(queue.begin(), queue.end(), [&batch](const Batch &queued) {
+                    return queued.fd == batch.fd && queued.id == batch.id;
+                }), queue.end());
+                client->queued = 0;
+                shutdown(batch.fd, SHUT_RD);
+            }
+            if (!Flush(batch.fd, *client))
+                Drop(batch.fd);
         }
 
-        void ClearBackgroundPIDs() {
-            backgroundPIDs.clear();
+        /**
+         * Runs body with stdout and stderr, its children's included, on fresh
+         * memfds. A background job keeps writing into its own memfd, never into
+         * a later command's output. True if either stream was cut at MAX_OUTPUT.
+         */
+        bool Capture(const std::function<void()> &body, std::string &out, std::string &err) {
+            int outFd = memfd_create("mysh-out", MFD_CLOEXEC);
+            int errFd = memfd_create("mysh-err", MFD_CLOEXEC);
+            if (outFd == -1 || errFd == -1 || savedOut == -1 || savedErr == -1) {
+                perror("memfd_create");
+                for (int fd : {outFd, errFd}) {
+                    if (fd != -1)
+                        close(fd);
+                }
+                out.clear();
+                err.clear();
+                body();
+                return false;
+            }
+
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(nullptr);
+            dup2(outFd, STDOUT_FILENO);
+            dup2(errFd, STDERR_FILENO);
+            body();
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(nullptr);
+            dup2(savedOut, STDOUT_FILENO);
+            dup2(savedErr, STDERR_FILENO);
+
+            bool truncated = ReadCapture(outFd, out);
+            truncated |= ReadCapture(errFd, err);
+            close(outFd);
+            close(errFd);
+            return truncated;
         }
 
-        void ListBackgroundPIDs() {
-            for (auto pid : backgroundPIDs) {
-                std::cout << "bg:" << pid << std::endl;
-            }
+        static bool ReadCapture(int fd, std::string &text) {
+            struct stat st{};
+            size_t size = fstat(fd, &st) == 0 ? (size_t) st.st_size : 0;
+            text.resize(std::min(size, MAX_OUTPUT));
+            ssize_t n = pread(fd, text.data(), text.size(), 0);
+            text.resize(n > 0 ? n : 0);
+            return size > MAX_OUTPUT;
         }
 
-        static char **InputParametersToCharArguments(std::vector<std::string> &inputParameters) {
-            char **arguments = nullptr;
-            int iPLen = inputParameters.size();
+        static long MicrosSince(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
 
-            arguments = new char *[iPLen + 1];
-            for (auto i = 0; i < iPLen; i++) {
-                arguments[i] = strdup(inputParameters[i].c_str());
+        static void AppendJson(std::string &json, std::string_view text) {
+            static const char hex[] = "0123456789abcdef";
+            json += '"';
+            for (char c : text) {
+                switch (c) {
+                    case '"':
+                        json += "\\\"";
+                        break;
+                    case '\\':
+                        json += "\\\\";
+                        break;
+                    case '\n':
+                        json += "\\n";
+                        break;
+                    case '\r':
+                        json += "\\r";
+                        break;
+                    case '\t':
+                        json += "\\t";
+                        break;
+                    default:
+                        if ((unsigned char) c < 0x20) {
+                            json += "\\u00";
+                            json += hex[(unsigned char) c >> 4];
+                            json += hex[c & 0xf];
+                        } else {
+                            json += c;
+                        }
+                }
             }
-            arguments[iPLen] = nullptr;
-
-            return arguments;
+            json += '"';
         }
     };
 
@@ -634,6 +6138,10 @@ class Mysh {
                     break;
                 case could_not_kill:
                     std::cout << "could not kill specified pid" << std::endl;
+                    break;
+                case syntax_error:
+                    std::cout << "syntax error: unterminated quote" << std::endl;
+                    break;
                 default:
                     break;
             }
@@ -641,11 +6149,19 @@ class Mysh {
     };
 
 public:
-    Mysh() {
-        this->commands = new std::vector<Command *>();
+    explicit Mysh(LineReader *input = nullptr) {
+        this->input = input != nullptr ? input : new LineReader(STDIN_FILENO);
+        this->lastStatus = 0;
+        this->eventLoop = new EventLoop();
+
+        // Regular files and -c text cannot be polled, those are read directly
+        inputPollable = this->input->Fd() != -1 && WatchInput();
+        if (inputPollable)
+            eventLoop->Remove(this->input->Fd());
 
         historyHandler = new HistoryHandler(this);
         exitHandler = new ExitHandler(this);
+        scriptHandler = new ScriptHandler(this);
         directoryHandler = new DirectoryHandler(this);
         processHandler = new ProcessHandler(this);
 
@@ -655,101 +6171,288 @@ public:
     ~Mysh() {
         delete historyHandler;
         delete exitHandler;
+        delete scriptHandler;
         delete directoryHandler;
+        delete processHandler;
 
         delete errorCodeHandler;
 
-        delete commands;
+        delete eventLoop;
+        delete input;
     }
 
-    void Start() {
+    int Start() {
         bool keepGoing = true;
         while (keepGoing) {
-            printPrompt();
-            ErrorCode ec = ProcessInput();
+            processHandler->ReapBackgroundPIDs();
+
+            // Batch input too, or a long script keeps every finished job in the table
+            processHandler->PrintNotices();
+            if (input->IsInteractive())
+                printPrompt();
+
+            // Child exits are handled while the shell waits for input. Input is
+            // watched only here, a readable or ended stdin would wake every
+            // other wait on the loop and keep it spinning
+            if (inputPollable && !input->HasLine()) {
+                WatchInput();
+                while (!input->HasLine())
+                    eventLoop->RunOnce(-1);
+                eventLoop->Remove(input->Fd());
+            }
+
+            std::string_view inputLine;
+            if (!input->NextLine(inputLine)) {
+                if (input->IsInteractive())
+                    std::cout << std::endl;
+                break;
+            }
+
+            ErrorCode ec = ProcessInput(inputLine);
 
             Mysh::ErrorCodeHandler::HandleErrorCode(ec);
 
             if (ec == 10) {
                 keepGoing = false;
-                std::cout << "ret code: " << ec << std::endl;
+                if (input->IsInteractive())
+                    std::cout << "ret code: " << ec << std::endl;
             }
         }
+        return lastStatus;
+    }
+
+    // mysh --serve, see ServerHandler
+    int Serve(const std::string &socketPath) {
+        ServerHandler server(this);
+        return server.Serve(socketPath);
+    }
+
+    static int Connect(const std::string &socketPath, const std::string &requests) {
+        return ServerHandler::Connect(socketPath, requests);
     }
 
 private:
     HistoryHandler *historyHandler;
     ExitHandler *exitHandler;
+    ScriptHandler *scriptHandler;
     DirectoryHandler *directoryHandler;
     ProcessHandler *processHandler;
 
     ErrorCodeHandler *errorCodeHandler;
 
-    std::vector<Command *> *commands;
+    EventLoop *eventLoop;
+    LineReader *input;
+    bool inputPollable;
+    // Set by --serve: blocking waits keep running the event loop for the other clients
+    bool serving = false;
+    Tokenizer tokenizer;
+    std::vector<std::string_view> parameters;
+    // Status of the last command: child exit status for launched programs,
+    // the ErrorCode for builtins that failed
+    int lastStatus;
+
+    CommandRegistry commands;
+
+    // Fails for input epoll cannot watch
+    bool WatchInput() {
+        return eventLoop->Add(input->Fd(), EPOLLIN, [this](uint32_t) { input->Fill(); });
+    }
 
     void printPrompt() {
-        std::cout << this->directoryHandler->GetCurrentDirectoryString() << "# ";
+        std::cout << this->directoryHandler->GetPrompt() << std::flush;
     }
 
-    ErrorCode ProcessInput() {
-        std::string inputLine;
-        std::getline(std::cin, inputLine);
+    ErrorCode ProcessInput(std::string_view inputLine) {
+        // "!N" and "!!" re-run an earlier entry, which is echoed and recorded as itself
+        std::string expanded;
+        if (inputLine.size() > 1 && inputLine[0] == '!') {
+            if (!historyHandler->ExpandInputHistory(inputLine, expanded)) {
+                std::cerr << inputLine << ": event not found" << std::endl;
+                lastStatus = 1;
+                return no_error;
+            }
+            std::cout << expanded << std::endl;
+            inputLine = expanded;
+        }
 
         historyHandler->UpdateInputHistory(inputLine);
+        ErrorCode ec = RunInput(inputLine);
+        historyHandler->FinishInputHistory(lastStatus);
+        return ec;
+    }
+
+    ErrorCode RunInput(std::string_view inputLine) {
+        if (!tokenizer.Tokenize(inputLine)) {
+            lastStatus = syntax_error;
+            return syntax_error;
+        }
 
-        std::vector<std::string> tokens = TokenizeInput(inputLine);
+        const std::vector<std::string_view> &tokens = tokenizer.tokens;
 
-        if (tokens[0].length() == 0) {
+        if (tokens.empty()) {
             return no_error;
         }
 
         Command *currentCommand = DetermineCommand(tokens[0]);
 
         if (currentCommand == nullptr) {
+            lastStatus = command_does_not_exist;
             return command_does_not_exist;
         }
 
-        auto parameters = std::vector<std::string>(tokens.begin() + 1, tokens.end());
+        // Reused across lines, so this copies views but allocates nothing
+        parameters.assign(tokens.begin() + 1, tokens.end());
 
-        if (!currentCommand->InputParametersAreValid(parameters)) {
-            return incorrect_parameters;
+        return ExecuteCommand(currentCommand, parameters);
+    }
+
+    // Runs a command line that is already split, keyword first
+    ErrorCode ExecuteCommand(std::vector<std::string_view> &commandLine) {
+        Command *command = DetermineCommand(commandLine[0]);
+
+        if (command == nullptr) {
+            lastStatus = command_does_not_exist;
+            return command_does_not_exist;
         }
 
-        return currentCommand->Execute(parameters);
+        std::vector<std::string_view> commandParameters(commandLine.begin() + 1, commandLine.end());
+        return ExecuteCommand(command, commandParameters);
     }
 
-    static std::vector<std::string> TokenizeInput(const std::string &line) {
-        auto const regex = std::regex{R"(\s+)"};
+    ErrorCode ExecuteCommand(Command *command, std::vector<std::string_view> &commandParameters) {
+        if (!command->InputParametersAreValid(commandParameters)) {
+            lastStatus = incorrect_parameters;
+            return incorrect_parameters;
+        }
 
-        auto tokens = std::vector<std::string>(
-                std::sregex_token_iterator{begin(line), end(line), regex, -1},
-                std::sregex_token_iterator{});
+        return ExecuteValidated(command, commandParameters);
+    }
 
-        return tokens;
+    // For parameters already checked against the command, like a parsed script's
+    ErrorCode ExecuteValidated(Command *command, std::vector<std::string_view> &commandParameters) {
+        lastStatus = 0;
+        ErrorCode ec = command->Execute(commandParameters);
+        if (ec != no_error && ec != request_exit)
+            lastStatus = ec;
+        return ec;
     }
 
-    Command *DetermineCommand(const std::string &firstToken) const {
-        Command *currentCommand = nullptr;
-        for (auto command : *commands) {
-            if (firstToken == command->keyword) {
-                currentCommand = command;
-            }
+    /**
+     * Replaces path with contents through a temporary file of this writer's
+     * own, renamed over it, so readers and concurrent writers see the old
+     * file or a whole new one. False with errno set if that failed.
+     */
+    static bool ReplaceFile(const std::string &path, const std::string &contents) {
+        std::string temporary = path + ".XXXXXX";
+        int fd = mkostemp(temporary.data(), O_CLOEXEC);
+        if (fd == -1)
+            return false;
+
+        // mkstemp makes it 0600, give it the mode fopen would have
+        mode_t mask = umask(0);
+        umask(mask);
+        bool written = fchmod(fd, 0666 & ~mask) == 0;
+        for (size_t done = 0; written && done < contents.size();) {
+            ssize_t n = write(fd, contents.data() + done, contents.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                written = false;
+            else
+                done += n;
         }
-        return currentCommand;
+        if (close(fd) != 0)
+            written = false;
+        if (written && rename(temporary.c_str(), path.c_str()) == 0)
+            return true;
+
+        int error = errno;
+        unlink(temporary.c_str());
+        errno = error;
+        return false;
+    }
+
+    // About 31 years, so every deadline still fits the time_t of a timerfd
+    static constexpr double MAX_DURATION = 1e9;
+
+    static bool ParseNumber(std::string_view text, long &value) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    }
+
+    // "2s", "500ms", "1.5m" or a bare number of seconds, up to MAX_DURATION
+    static bool ParseDuration(std::string_view text, double &seconds) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), seconds);
+        if (result.ec != std::errc())
+            return false;
+
+        std::string_view unit(result.ptr, text.data() + text.size() - result.ptr);
+        if (unit == "ms")
+            seconds /= 1000;
+        else if (unit == "m")
+            seconds *= 60;
+        else if (!unit.empty() && unit != "s")
+            return false;
+        // Also turns away nan and inf, which from_chars accepts
+        return seconds >= 0 && seconds <= MAX_DURATION;
+    }
+
+    Command *DetermineCommand(std::string_view firstToken) const {
+        return commands.Find(firstToken);
     }
 };
 
 
-int TestMysh() {
-    Mysh *mysh = new Mysh();
+int TestMysh(int argc, char **argv) {
+    Mysh::LineReader *input = nullptr;
+
+    if (argc == 3 && std::string(argv[1]) == "--serve") {
+        Mysh *server = new Mysh(new Mysh::LineReader(std::string()));
+        int status = server->Serve(argv[2]);
+        delete server;
+        return status;
+    }
+
+    if ((argc == 3 || (argc == 5 && std::string(argv[3]) == "-c")) && std::string(argv[1]) == "--connect") {
+        std::string requests;
+        if (argc == 5) {
+            requests = argv[4];
+        } else {
+            char chunk[65536];
+            ssize_t n;
+            while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0)
+                requests.append(chunk, n);
+        }
+        if (!requests.empty() && requests.back() != '\n')
+            requests += '\n';
+        return Mysh::Connect(argv[2], requests);
+    }
+
+    if (argc == 3 && std::string(argv[1]) == "-f") {
+        input = Mysh::LineReader::FromFile(argv[2]);
+        if (input == nullptr) {
+            perror(argv[2]);
+            return 127;
+        }
+    } else if (argc == 3 && std::string(argv[1]) == "-c") {
+        input = new Mysh::LineReader(std::string(argv[2]));
+    } else if (argc != 1) {
+        std::cerr << "usage: mysh [-f script | -c commands | --serve socket | --connect socket [-c commands]]"
+                  << std::endl;
+        return incorrect_parameters;
+    }
 
-    mysh->Start();
+    Mysh *mysh = new Mysh(input);
+
+    int status = mysh->Start();
 
     delete mysh;
 
-    return 0;
+    return status;
 }
 
-int main() {
-    TestMysh();
-}
\ No newline at end of file
+#ifndef MYSH_NO_MAIN
+int main(int argc, char **argv) {
+    return TestMysh(argc, argv);
+}
+#endif